@@ -28,6 +28,12 @@ ifeq (,$(HAS_DLOPEN))
 $(call LINK_CHECK,dlopen)
 endif
 $(call LINK_CHECK,posix_memalign)
+$(call LINK_CHECK,splice)
+$(call LINK_CHECK,copy_file_range)
+$(call LINK_CHECK,pthread_create,-lpthread)
+ifeq (,$(HAS_PTHREAD_CREATE))
+$(call LINK_CHECK,pthread_create)
+endif
 
 # Generate cache file
 $(shell ($(foreach var,$(filter-out $(__VARS) __%,$(.VARIABLES)),echo '$(var) = $($(var))';)) > config.cache)
@@ -15,7 +15,7 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -213,6 +213,213 @@ static int cmd_copy_file(vmfs_dir_t *base_dir,int argc,char *argv[])
    return(0);
 }
 
+/* Size of the reads done by the "export" command */
+#define EXPORT_BUF_SIZE  (16 * 1048576)
+
+/* 
+ * Skip zeroes in the output of the "export" command. base is the output
+ * offset the file starts at, or -1 when the output can't be seeked.
+ */
+static int export_zeroes(int fd,int seekable,off_t base,off_t pos,
+                         uint64_t len,u_char *buf,size_t buf_len)
+{
+   size_t clen;
+
+   /* Nothing needs to be written to a new regular file */
+   if (seekable)
+      return(0);
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+   if ((base != -1) &&
+       !fallocate(fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,base+pos,len) &&
+       (lseek(fd,base+pos+len,SEEK_SET) != -1))
+      return(0);
+#endif
+
+   memset(buf,0,m_min(len,buf_len));
+   for(;len;len-=clen) {
+      clen = m_min(len,buf_len);
+      if (write(fd,buf,clen) != clen)
+         return(-1);
+   }
+   return(0);
+}
+
+/* "export" command: copy a file out of the VMFS, keeping it sparse */
+static int cmd_export(vmfs_dir_t *base_dir,int argc,char *argv[])
+{
+   vmfs_extent_t ext;
+   vmfs_file_t *f;
+   struct stat st;
+   uint64_t file_size;
+   u_char *buf = NULL;
+   int fd,seekable,ret = -1;
+   ssize_t len;
+   off_t base,pos;
+
+   if (argc == 0) {
+      fprintf(stderr,"Usage: export <filespec> [output]\n");
+      return(-1);
+   }
+
+   if (!(f = vmfs_file_open_from_filespec(base_dir,argv[0]))) {
+      fprintf(stderr,"Unable to open file '%s'\n",argv[0]);
+      return(-1);
+   }
+
+   if (argc > 1) {
+      if ((fd = open(argv[1],O_WRONLY|O_CREAT|O_TRUNC,0644)) == -1) {
+         fprintf(stderr,"Unable to open '%s'\n",argv[1]);
+         vmfs_file_close(f);
+         return(-1);
+      }
+   } else {
+      fflush(stdout);
+      fd = fileno(stdout);
+   }
+
+   /* 
+    * Holes in regular files are made by seeking over them. Writes to an
+    * output opened for appending ignore the offset, so it is never seeked.
+    */
+   if (fcntl(fd,F_GETFL) & O_APPEND)
+      base = -1;
+   else
+      base = lseek(fd,0,SEEK_CUR);
+
+   seekable = !fstat(fd,&st) && S_ISREG(st.st_mode) && (base == 0) &&
+              !ftruncate(fd,0);
+
+   if (!(buf = iobuffer_alloc(EXPORT_BUF_SIZE))) {
+      fprintf(stderr,"Unable to allocate memory\n");
+      goto end;
+   }
+
+   file_size = vmfs_file_get_size(f);
+
+   for(pos=0;pos<file_size;pos+=ext.len) {
+      if (vmfs_file_get_extent(f,pos,0,&ext) < 0) {
+         fprintf(stderr,"Unable to get extent at 0x%"PRIx64"\n",
+                 (uint64_t)pos);
+         goto end;
+      }
+
+      /* Unallocated and TBZ blocks read as zeroes */
+      if (ext.type != VMFS_EXTENT_DATA) {
+         if (export_zeroes(fd,seekable,base,pos,ext.len,
+                           buf,EXPORT_BUF_SIZE)) {
+            fprintf(stderr,"Error writing output file\n");
+            goto end;
+         }
+         continue;
+      }
+
+      for(len=0;len<ext.len;len+=EXPORT_BUF_SIZE) {
+         size_t clen = m_min(ext.len-len,EXPORT_BUF_SIZE);
+
+         if (vmfs_file_pread(f,buf,clen,pos+len) != clen) {
+            fprintf(stderr,"Error reading input file\n");
+            goto end;
+         }
+
+         if ((seekable && (pwrite(fd,buf,clen,pos+len) != clen)) ||
+             (!seekable && (write(fd,buf,clen) != clen))) {
+            fprintf(stderr,"Error writing output file\n");
+            goto end;
+         }
+      }
+   }
+
+   /* Trailing holes */
+   if (seekable && ftruncate(fd,file_size)) {
+      fprintf(stderr,"Error writing output file\n");
+      goto end;
+   }
+
+   /* Seeking over holes doesn't extend other regular files either */
+   if (!seekable && (base != -1) && !fstat(fd,&st) && S_ISREG(st.st_mode) &&
+       (st.st_size < base + file_size) && ftruncate(fd,base + file_size)) {
+      fprintf(stderr,"Error writing output file\n");
+      goto end;
+   }
+
+   ret = 0;
+end:
+   iobuffer_free(buf);
+   if (argc > 1)
+      close(fd);
+   vmfs_file_close(f);
+   return(ret);
+}
+
+/* Report finished files for the "extract" command */
+static void extract_progress(const vmfs_extract_job_t *job,void *opt_arg)
+{
+   if (!job->finished)
+      return;
+
+   if (job->error)
+      fprintf(stderr,"%s: %s\n",job->src,strerror(-job->error));
+   else
+      fprintf(stderr,"%s -> %s: %"PRIu64" bytes\n",job->src,job->dst,
+              job->size);
+}
+
+/* "extract" command: copy files to a host directory, in parallel */
+static int cmd_extract(vmfs_dir_t *base_dir,int argc,char *argv[])
+{
+   vmfs_extract_job_t *jobs;
+   u_int threads = 4;
+   int i,count,res;
+   char *name,*dst;
+
+   if ((argc > 1) && !strcmp(argv[0],"-j")) {
+      threads = atoi(argv[1]);
+      argc -= 2;
+      argv += 2;
+   }
+
+   if (argc < 2) {
+      fprintf(stderr,"Usage: extract [-j threads] <directory> <filespec>...\n");
+      return(-1);
+   }
+
+   count = argc - 1;
+   if (!(jobs = calloc(count,sizeof(*jobs)))) {
+      fprintf(stderr,"Unable to allocate memory\n");
+      return(-1);
+   }
+
+   for(i=0;i<count;i++) {
+      name = m_basename(argv[i+1]);
+      if (!name || (asprintf(&dst,"%s/%s",argv[0],name) == -1))
+         dst = NULL;
+      free(name);
+      jobs[i].src = argv[i+1];
+      jobs[i].dst = dst;
+      if (!dst) {
+         fprintf(stderr,"Unable to allocate memory\n");
+         res = -1;
+         goto end;
+      }
+
+      /* Files that can't be opened are reported as failed jobs */
+      jobs[i].f = vmfs_file_open_from_filespec(base_dir,argv[i+1]);
+   }
+
+   res = vmfs_extract(vmfs_dir_get_fs(base_dir),jobs,count,threads,0,
+                      extract_progress,NULL);
+
+ end:
+   for(i=0;i<count;i++) {
+      /* Files are only left open when vmfs_extract() wasn't called */
+      vmfs_file_close(jobs[i].f);
+      free((char *)jobs[i].dst);
+   }
+   free(jobs);
+   return(res ? -1 : 0);
+}
+
 /* "chmod" command */
 static int cmd_chmod(vmfs_dir_t *base_dir,int argc,char *argv[])
 {
@@ -259,7 +466,7 @@ static int cmd_df(vmfs_dir_t *base_dir,int argc,char *argv[])
    uint32_t alloc,total;
 
    total = fs->fbb->bmh.total_items;
-   alloc = vmfs_bitmap_allocated_items(fs->fbb);
+   alloc = vmfs_fs_get_allocated_items(fs,VMFS_BLK_TYPE_FB);
 
    printf("Block size       : %"PRIu64" bytes\n",vmfs_fs_get_blocksize(fs));
 
@@ -309,6 +516,47 @@ static int cmd_get_file_block(vmfs_dir_t *base_dir,int argc,char *argv[])
    return ret;
 }
 
+/* Show the extent map of a file */
+static int cmd_extents(vmfs_dir_t *base_dir,int argc,char *argv[])
+{
+   static const char *types[] = { "hole", "tbz", "data" };
+   vmfs_extent_t ext;
+   vmfs_file_t *f;
+   off_t pos;
+   int res = 0;
+
+   if (argc == 0) {
+      fprintf(stderr,"Usage: extents <filespec>\n");
+      return(-1);
+   }
+
+   if (!(f = vmfs_file_open_from_filespec(base_dir,argv[0]))) {
+      fprintf(stderr,"Unable to open file '%s'\n",argv[0]);
+      return(-1);
+   }
+
+   printf("%-18s %-18s %-4s %s\n","Offset","Length","Type","Block");
+
+   for(pos=0;pos<vmfs_file_get_size(f);pos+=ext.len) {
+      if ((res = vmfs_file_get_extent(f,pos,1,&ext)) < 0) {
+         fprintf(stderr,"Unable to get extent at 0x%"PRIx64"\n",
+                 (uint64_t)pos);
+         break;
+      }
+
+      printf("0x%16.16"PRIx64" 0x%16.16"PRIx64" %-4s ",
+             (uint64_t)ext.pos,ext.len,types[ext.type]);
+
+      if (ext.type == VMFS_EXTENT_HOLE)
+         printf("-\n");
+      else
+         printf("0x%8.8x\n",ext.blk_id);
+   }
+
+   vmfs_file_close(f);
+   return(res < 0 ? -1 : 0);
+}
+
 /* Check volume bitmaps */
 static int cmd_check_vol_bitmaps(vmfs_dir_t *base_dir,int argc,char *argv[])
 {
@@ -331,6 +579,149 @@ static int cmd_check_vol_bitmaps(vmfs_dir_t *base_dir,int argc,char *argv[])
    return(errors);
 }
 
+/* Free space statistics, gathered by cmd_free_space() */
+#define FREE_SPACE_HIST_BUCKETS  32
+
+struct free_space_stats {
+   uint32_t free_items;
+   uint32_t extents;
+   uint32_t largest,largest_addr;
+   uint32_t hist_extents[FREE_SPACE_HIST_BUCKETS];
+   uint32_t hist_items[FREE_SPACE_HIST_BUCKETS];
+   uint32_t items_per_area;
+   uint32_t *area_free;
+};
+
+/* Account a free extent, in a power of two histogram bucket */
+static void free_space_add_run(vmfs_bitmap_t *b,uint32_t addr,uint32_t len,
+                               void *opt_arg)
+{
+   struct free_space_stats *st = opt_arg;
+   u_int bucket = 31 - __builtin_clz(len);
+   uint32_t area,count;
+
+   st->free_items += len;
+   st->extents++;
+   st->hist_extents[bucket]++;
+   st->hist_items[bucket] += len;
+
+   if (len > st->largest) {
+      st->largest = len;
+      st->largest_addr = addr;
+   }
+
+   /* Split the extent at area boundaries for per-area utilization */
+   while(len > 0) {
+      area  = addr / st->items_per_area;
+      count = m_min(len,(area + 1) * st->items_per_area - addr);
+      st->area_free[area] += count;
+      addr += count;
+      len  -= count;
+   }
+}
+
+/* Show free space fragmentation */
+static int cmd_free_space(vmfs_dir_t *base_dir,int argc,char *argv[])
+{
+   const vmfs_fs_t *fs = vmfs_dir_get_fs(base_dir);
+   vmfs_bitmap_t *b = fs->fbb;
+   struct free_space_stats st;
+   uint32_t area_items,area_used;
+   uint64_t blk_size;
+   const char *sep;
+   double score;
+   int json = 0;
+   u_int i;
+
+   if ((argc >= 1) && (strcmp(argv[0],"-j") == 0))
+      json = 1;
+
+   memset(&st,0,sizeof(st));
+   st.items_per_area = b->bmh.bmp_entries_per_area *
+      b->bmh.items_per_bitmap_entry;
+
+   if (!(st.area_free = calloc(b->bmh.area_count,sizeof(uint32_t)))) {
+      fprintf(stderr,"Unable to allocate memory\n");
+      return(-1);
+   }
+
+   vmfs_bitmap_foreach_free_run(b,free_space_add_run,&st);
+
+   /* 
+    * Fragmentation score: 0 when all the free space is a single extent,
+    * 100 when it is only made of single blocks.
+    */
+   score = (st.free_items > 1) ?
+      (100.0 * (st.extents - 1)) / (st.free_items - 1) : 0.0;
+
+   blk_size = vmfs_fs_get_blocksize(fs);
+
+   if (json) {
+      printf("{\n");
+      printf("  \"block_size\": %"PRIu64",\n",blk_size);
+      printf("  \"total_blocks\": %u,\n",b->bmh.total_items);
+      printf("  \"free_blocks\": %u,\n",st.free_items);
+      printf("  \"free_extents\": %u,\n",st.extents);
+      printf("  \"largest_free_extent\": { \"block\": %u, \"length\": %u },\n",
+             VMFS_BLK_FB_BUILD(st.largest_addr, 0),st.largest);
+      printf("  \"fragmentation_score\": %.2f,\n",score);
+      printf("  \"histogram\": [");
+
+      for(i=0,sep="";i<FREE_SPACE_HIST_BUCKETS;i++) {
+         if (!st.hist_extents[i])
+            continue;
+
+         printf("%s\n    { \"min\": %u, \"max\": %u, "
+                "\"extents\": %u, \"blocks\": %u }",
+                sep,1U << i,(2U << i) - 1,st.hist_extents[i],st.hist_items[i]);
+         sep = ",";
+      }
+
+      printf("\n  ],\n");
+      printf("  \"areas\": [");
+   } else {
+      printf("Total blocks        : %u\n",b->bmh.total_items);
+      printf("Free blocks         : %u\n",st.free_items);
+      printf("Free extents        : %u\n",st.extents);
+      printf("Largest free extent : %u blocks (%"PRIu64" MiB) at 0x%8.8x\n",
+             st.largest,(blk_size * st.largest) / 1048576,
+             VMFS_BLK_FB_BUILD(st.largest_addr, 0));
+      printf("Fragmentation score : %.2f\n",score);
+
+      printf("\nFree extents size histogram (in blocks):\n");
+
+      for(i=0;i<FREE_SPACE_HIST_BUCKETS;i++) {
+         if (!st.hist_extents[i])
+            continue;
+
+         printf("  %10u - %10u : %u extents, %u blocks\n",
+                1U << i,(2U << i) - 1,st.hist_extents[i],st.hist_items[i]);
+      }
+
+      printf("\nArea utilization:\n");
+   }
+
+   for(i=0;i<b->bmh.area_count;i++) {
+      area_items = m_min(st.items_per_area,
+                         b->bmh.total_items - i*st.items_per_area);
+      area_used  = area_items - st.area_free[i];
+
+      if (json)
+         printf("%s\n    { \"area\": %u, \"used\": %u, \"total\": %u }",
+                i ? "," : "",i,area_used,area_items);
+      else
+         printf("  Area %u : %u/%u blocks used (%.1f%%)\n",i,
+                area_used,area_items,
+                area_items ? (100.0 * area_used) / area_items : 0.0);
+   }
+
+   if (json)
+      printf("\n  ]\n}\n");
+
+   free(st.area_free);
+   return(0);
+}
+
 /* Show active heartbeats */
 static int cmd_show_heartbeats(vmfs_dir_t *base_dir,int argc,char *argv[])
 {
@@ -498,11 +889,15 @@ struct cmd cmd_array[] = {
    { "ls", "List files in specified directory", cmd_ls },
    { "truncate", "Truncate file", cmd_truncate },
    { "copy_file", "Copy a file to VMFS volume", cmd_copy_file },
+   { "export", "Copy a file from VMFS volume", cmd_export },
+   { "extract", "Copy files from VMFS volume in parallel", cmd_extract },
    { "chmod", "Change permissions", cmd_chmod },
    { "mkdir", "Create a directory", cmd_mkdir },
    { "df", "Show available free space", cmd_df },
    { "get_file_block", "Get file block", cmd_get_file_block },
+   { "extents", "Show file extent map", cmd_extents },
    { "check_vol_bitmaps", "Check volume bitmaps", cmd_check_vol_bitmaps },
+   { "free_space", "Show free space fragmentation", cmd_free_space },
    { "show_heartbeats", "Show active heartbeats", cmd_show_heartbeats },
    { "read_block", "Read a block", cmd_read_block },
    { "alloc_block_fixed", "Allocate block (fixed)", cmd_alloc_block_fixed },
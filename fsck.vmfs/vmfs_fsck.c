@@ -27,6 +27,7 @@
 #include <grp.h>
 #include <sys/wait.h>
 #include <libgen.h>
+#include <pthread.h>
 #include "vmfs.h"
 
 /* Forward declarations */
@@ -85,6 +86,11 @@ struct vmfs_fsck_info {
    /* Lost blocks (ie allocated but not used) */
    u_int lost_blocks;
 
+   /* Lost blocks found by the current bitmap scan, not reported yet */
+   pthread_mutex_t lost_lock;
+   uint32_t *lost_list;
+   u_int lost_list_count,lost_list_size;
+
    /* Directory structure errors */
    u_int dir_struct_errors;
 };
@@ -413,6 +419,47 @@ void vmfs_fsck_show_orphaned_inodes(vmfs_fsck_info_t *fi)
    }
 }
 
+/* Record a lost block (called concurrently by bitmap scan threads) */
+static void vmfs_fsck_add_lost(vmfs_fsck_info_t *fi,uint32_t blk_id,
+                               const char *desc)
+{
+   uint32_t *list;
+   u_int size;
+
+   pthread_mutex_lock(&fi->lost_lock);
+   fi->lost_blocks++;
+
+   if (fi->lost_list_count == fi->lost_list_size) {
+      size = fi->lost_list_size ? fi->lost_list_size * 2 : 256;
+
+      if (!(list = realloc(fi->lost_list,size * sizeof(uint32_t)))) {
+         /* Report it right away, out of order */
+         printf("%s 0x%8.8x is lost.\n",desc,blk_id);
+         pthread_mutex_unlock(&fi->lost_lock);
+         return;
+      }
+
+      fi->lost_list = list;
+      fi->lost_list_size = size;
+   }
+
+   fi->lost_list[fi->lost_list_count++] = blk_id;
+   pthread_mutex_unlock(&fi->lost_lock);
+}
+
+/* Report the lost blocks found by the last bitmap scan, in bitmap order */
+static void vmfs_fsck_show_lost(vmfs_fsck_info_t *fi,const char *desc)
+{
+   u_int i;
+
+   qsort(fi->lost_list,fi->lost_list_count,sizeof(uint32_t),vmfs_block_cmp);
+
+   for(i=0;i<fi->lost_list_count;i++)
+      printf("%s 0x%8.8x is lost.\n",desc,fi->lost_list[i]);
+
+   fi->lost_list_count = 0;
+}
+
 /* Check if a File Block is lost */
 void vmfs_fsck_check_fb_lost(vmfs_bitmap_t *b,uint32_t addr,void *opt)
 {
@@ -421,10 +468,8 @@ void vmfs_fsck_check_fb_lost(vmfs_bitmap_t *b,uint32_t addr,void *opt)
 
    blk_id = VMFS_BLK_FB_BUILD(addr, 0);
 
-   if (!vmfs_block_map_find(fi->blk_map,blk_id)) {
-      printf("File Block 0x%8.8x is lost.\n",blk_id);
-      fi->lost_blocks++;
-   }
+   if (!vmfs_block_map_find(fi->blk_map,blk_id))
+      vmfs_fsck_add_lost(fi,blk_id,"File Block");
 }
 
 /* Check if a Sub-Block is lost */
@@ -439,10 +484,8 @@ void vmfs_fsck_check_sb_lost(vmfs_bitmap_t *b,uint32_t addr,void *opt)
 
    blk_id = VMFS_BLK_SB_BUILD(entry, item, 0);
 
-   if (!vmfs_block_map_find(fi->blk_map,blk_id)) {
-      printf("Sub-Block 0x%8.8x is lost.\n",blk_id);
-      fi->lost_blocks++;
-   }
+   if (!vmfs_block_map_find(fi->blk_map,blk_id))
+      vmfs_fsck_add_lost(fi,blk_id,"Sub-Block");
 }
 
 /* Check if a Pointer Block is lost */
@@ -457,10 +500,8 @@ void vmfs_fsck_check_pb_lost(vmfs_bitmap_t *b,uint32_t addr,void *opt)
 
    blk_id = VMFS_BLK_PB_BUILD(entry, item, 0);
 
-   if (!vmfs_block_map_find(fi->blk_map,blk_id)) {
-      printf("Pointer Block 0x%8.8x is lost.\n",blk_id);
-      fi->lost_blocks++;
-   }
+   if (!vmfs_block_map_find(fi->blk_map,blk_id))
+      vmfs_fsck_add_lost(fi,blk_id,"Pointer Block");
 }
 
 /* Check the directory has minimal . and .. entries with correct inode IDs */
@@ -516,6 +557,7 @@ static void vmfs_fsck_init(vmfs_fsck_info_t *fi)
 {
    memset(fi,0,sizeof(*fi));
    fi->dir_map = vmfs_dir_map_alloc_root();
+   pthread_mutex_init(&fi->lost_lock,NULL);
 }
 
 static void show_usage(char *prog_name) 
@@ -532,6 +574,7 @@ int main(int argc,char *argv[])
    vmfs_fs_t *fs;
    vmfs_flags_t flags;
    vmfs_dir_t *root_dir;
+   long num_threads;
 
    if (argc < 2) {
       show_usage(argv[0]);
@@ -558,9 +601,23 @@ int main(int argc,char *argv[])
    vmfs_fsck_count_blocks(&fsck_info);
    vmfs_fsck_show_orphaned_inodes(&fsck_info);
 
-   vmfs_bitmap_foreach(fs->fbb,vmfs_fsck_check_fb_lost,&fsck_info);
-   vmfs_bitmap_foreach(fs->sbc,vmfs_fsck_check_sb_lost,&fsck_info);
-   vmfs_bitmap_foreach(fs->pbc,vmfs_fsck_check_pb_lost,&fsck_info);
+   /* Scan bitmaps for lost blocks, with one thread per online CPU */
+   num_threads = m_max(sysconf(_SC_NPROCESSORS_ONLN),1);
+
+   vmfs_bitmap_foreach_mt(fs->fbb,num_threads,
+                          vmfs_fsck_check_fb_lost,&fsck_info);
+   vmfs_fsck_show_lost(&fsck_info,"File Block");
+
+   vmfs_bitmap_foreach_mt(fs->sbc,num_threads,
+                          vmfs_fsck_check_sb_lost,&fsck_info);
+   vmfs_fsck_show_lost(&fsck_info,"Sub-Block");
+
+   vmfs_bitmap_foreach_mt(fs->pbc,num_threads,
+                          vmfs_fsck_check_pb_lost,&fsck_info);
+   vmfs_fsck_show_lost(&fsck_info,"Pointer Block");
+
+   free(fsck_info.lost_list);
+   pthread_mutex_destroy(&fsck_info.lost_lock);
 
    vmfs_fsck_check_dir_all(&fsck_info);
 
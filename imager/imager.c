@@ -29,16 +29,34 @@
  *       In format version < 2, following 512B are a raw block.
  * 0x01: following chars are the number of blocks (512B) with zeroed data - 1
  *       in a variable-length encoding.
+ * 0x7e: In format version >= 3, ends the sequences. It is followed by an
+ *       index giving, for every 64th sequence, the number of the first 512B
+ *       block it covers and its offset in the image, as little-endian 64-bit
+ *       pairs. The image then ends with the little-endian 64-bit offset of
+ *       the 0x7e byte, the number of index entries, and the total number of
+ *       512B blocks.
  * 0x7f: following 4 bytes is the little-endian encoded Adler-32 checksum.
  *
+ * Images are created in format version 2, unless -i is given, in which case
+ * an index is added so that libvmfs can open them as devices.
+ * Compression uses one thread per CPU, unless -j gives a number of threads
+ * (up to 256).
+ * With -f, the image is created from a file on a VMFS filesystem instead of
+ * stdin, and unallocated or to-be-zeroed blocks are never read.
+ * With -a, the image is created from the first given VMFS device (the others
+ * being the remaining extents of the filesystem), and file blocks marked
+ * free in the file block bitmap are stored as zeroes without being read.
  */
 
-#define FORMAT_VERSION 2
+#define FORMAT_VERSION 3
 
-#ifdef __linux__
-#include <sys/ioctl.h>
-#include <linux/fs.h>
-#endif
+/* Format version of images created without an index */
+#define NOINDEX_FORMAT_VERSION 2
+
+/* Number of sequences between two index entries */
+#define INDEX_INTERVAL 64
+
+#define _GNU_SOURCE
 #include <sys/stat.h>
 #include <libgen.h>
 #include <stdarg.h>
@@ -49,6 +67,13 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <string.h>
+#include <pthread.h>
+#include "vmfs.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 static void die(char *fmt, ...)
 {
@@ -63,7 +88,11 @@ static void show_usage(char *prog_name)
 {
    char *name = basename(prog_name);
 
-   fprintf(stderr, "Syntax: %s [-x|-r] <image>\n",name);
+   fprintf(stderr, "Syntax: %s [-i] [-j threads] [<device>]\n",name);
+   fprintf(stderr, "       %s [-i] [-j threads] -f <path> <device> [<device>...]\n",name);
+   fprintf(stderr, "       %s [-i] [-j threads] -a <device> [<device>...]\n",name);
+   fprintf(stderr, "       %s [-i] [-j threads] -r <image>\n",name);
+   fprintf(stderr, "       %s [-x|-v] <image>\n",name);
 }
 
 static size_t do_reads(void *buf, size_t sz, size_t count)
@@ -89,6 +118,9 @@ static size_t do_read(void *buf, size_t count)
    return do_reads(buf, count, 1);
 }
 
+/* Number of bytes written so far */
+static uint64_t out_pos = 0;
+
 static void do_write(const void *buf, size_t count)
 {
    ssize_t hlen = 0, len;
@@ -104,6 +136,7 @@ static void do_write(const void *buf, size_t count)
    }
    if (hlen != count)
       die("Short write\n");
+   out_pos += hlen;
 }
 
 #define BLK_SIZE 512
@@ -112,40 +145,186 @@ static const u_char const zero_blk[BLK_SIZE] = {0,};
 
 #define ADLER32_MODULO 65521
 
-static struct {
+struct adler32 {
    uint32_t sum1, sum2;
-} adler32 = { 1, 0 };
+};
 
-static void adler32_add(const u_char *buf, size_t blks)
+static struct adler32 adler32 = { 1, 0 };
+
+/*
+ * Largest number of bytes that can be summed before sum2 may overflow 32
+ * bits, and thus before the modulo needs to be applied.
+ */
+#define ADLER32_NMAX 5552
+
+static void adler32_generic(struct adler32 *a, const u_char *buf, size_t len)
+{
+   uint32_t sum1 = a->sum1, sum2 = a->sum2;
+   size_t n;
+
+   while (len) {
+      n = (len < ADLER32_NMAX) ? len : ADLER32_NMAX;
+      len -= n;
+      #define adler32_step sum1 += (*buf++); sum2 += sum1
+      #define fourtimes(stuff) stuff; stuff; stuff; stuff
+      for (; n >= 16; n -= 16) {
+         fourtimes(fourtimes(adler32_step));
+      }
+      while (n--) {
+         adler32_step;
+      }
+      sum1 %= ADLER32_MODULO;
+      sum2 %= ADLER32_MODULO;
+   }
+
+   a->sum1 = sum1;
+   a->sum2 = sum2;
+}
+
+#ifdef X86_SIMD
+/*
+ * The vectorized versions sum bytes with psadbw, and weight them by their
+ * distance to the end of the vector for sum2. The sums of sum1 before
+ * each vector are accumulated separately, and multiplied by the vector
+ * size at the end of each span of ADLER32_NMAX bytes.
+ */
+static inline uint64_t hsum_epi32(const uint32_t *v, int n)
+{
+   uint64_t sum = 0;
+   while (n--)
+      sum += *v++;
+   return sum;
+}
+
+__attribute__((target("sse2")))
+static void adler32_sse2(struct adler32 *a, const u_char *buf, size_t len)
+{
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i w_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+   const __m128i w_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+   uint32_t sum1 = a->sum1, sum2 = a->sum2;
+   uint32_t t1[4], tp[4], t2[4];
+
+   while (len >= 16) {
+      size_t n = ((len < ADLER32_NMAX) ? len : ADLER32_NMAX) / 16;
+      __m128i v_s1 = zero, v_ps = zero, v_s2 = zero;
+      uint64_t s2 = sum2 + (uint64_t) sum1 * n * 16;
+
+      len -= n * 16;
+      while (n--) {
+         __m128i v = _mm_loadu_si128((const __m128i *) buf);
+         v_ps = _mm_add_epi32(v_ps, v_s1);
+         v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(v, zero));
+         v_s2 = _mm_add_epi32(v_s2,
+                   _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), w_lo));
+         v_s2 = _mm_add_epi32(v_s2,
+                   _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), w_hi));
+         buf += 16;
+      }
+
+      _mm_storeu_si128((__m128i *) t1, v_s1);
+      _mm_storeu_si128((__m128i *) tp, v_ps);
+      _mm_storeu_si128((__m128i *) t2, v_s2);
+      s2 += 16 * hsum_epi32(tp, 4) + hsum_epi32(t2, 4);
+      sum1 = (sum1 + hsum_epi32(t1, 4)) % ADLER32_MODULO;
+      sum2 = s2 % ADLER32_MODULO;
+   }
+
+   a->sum1 = sum1;
+   a->sum2 = sum2;
+   if (len)
+      adler32_generic(a, buf, len);
+}
+
+__attribute__((target("avx2")))
+static void adler32_avx2(struct adler32 *a, const u_char *buf, size_t len)
+{
+   const __m256i zero = _mm256_setzero_si256();
+   const __m256i ones = _mm256_set1_epi16(1);
+   const __m256i w = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                      24, 23, 22, 21, 20, 19, 18, 17,
+                                      16, 15, 14, 13, 12, 11, 10, 9,
+                                      8, 7, 6, 5, 4, 3, 2, 1);
+   uint32_t sum1 = a->sum1, sum2 = a->sum2;
+   uint32_t t1[8], tp[8], t2[8];
+
+   while (len >= 32) {
+      size_t n = ((len < ADLER32_NMAX) ? len : ADLER32_NMAX) / 32;
+      __m256i v_s1 = zero, v_ps = zero, v_s2 = zero;
+      uint64_t s2 = sum2 + (uint64_t) sum1 * n * 32;
+
+      len -= n * 32;
+      while (n--) {
+         __m256i v = _mm256_loadu_si256((const __m256i *) buf);
+         v_ps = _mm256_add_epi32(v_ps, v_s1);
+         v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(v, zero));
+         v_s2 = _mm256_add_epi32(v_s2,
+                   _mm256_madd_epi16(_mm256_maddubs_epi16(v, w), ones));
+         buf += 32;
+      }
+
+      _mm256_storeu_si256((__m256i *) t1, v_s1);
+      _mm256_storeu_si256((__m256i *) tp, v_ps);
+      _mm256_storeu_si256((__m256i *) t2, v_s2);
+      s2 += 32 * hsum_epi32(tp, 8) + hsum_epi32(t2, 8);
+      sum1 = (sum1 + hsum_epi32(t1, 8)) % ADLER32_MODULO;
+      sum2 = s2 % ADLER32_MODULO;
+   }
+
+   a->sum1 = sum1;
+   a->sum2 = sum2;
+   if (len)
+      adler32_generic(a, buf, len);
+}
+#endif
+
+static void (*adler32_kernel)(struct adler32 *a, const u_char *buf,
+                              size_t len) = adler32_generic;
+
+static void adler32_update(struct adler32 *a, const u_char *buf, size_t blks)
 {
    size_t i;
    if (buf == zero_blk) {
       i = blks;
       while (i >= 65536 / BLK_SIZE) {
-         adler32.sum2 = (adler32.sum2 + 65536 * adler32.sum1) % ADLER32_MODULO;
+         a->sum2 = (a->sum2 + 65536 * a->sum1) % ADLER32_MODULO;
          i -= 65536 / BLK_SIZE;
       }
-      adler32.sum2 = (adler32.sum2 + i * BLK_SIZE * adler32.sum1) % ADLER32_MODULO;
-   } else {
-      uint32_t sum;
-      while(blks--) {
-         for (i = 0, sum = 0; i < BLK_SIZE / 16; i++) {
-            #define adler32_step sum += (*buf++); adler32.sum2 += sum
-            #define fourtimes(stuff) stuff; stuff; stuff; stuff
-            fourtimes(fourtimes(adler32_step));
-         }
-         adler32.sum2 += adler32.sum1 * BLK_SIZE;
-         adler32.sum1 += sum;
+      a->sum2 = (a->sum2 + i * BLK_SIZE * a->sum1) % ADLER32_MODULO;
+   } else
+      adler32_kernel(a, buf, blks * BLK_SIZE);
+}
 
-         adler32.sum1 %= ADLER32_MODULO;
-         adler32.sum2 %= ADLER32_MODULO;
-      }
-   }
+static void adler32_add(const u_char *buf, size_t blks)
+{
+   adler32_update(&adler32, buf, blks);
+}
+
+/*
+ * Append the checksum b of len bytes to the checksum a, as if the data
+ * had been checksummed in one go.
+ */
+static void adler32_combine(struct adler32 *a, const struct adler32 *b,
+                            uint64_t len)
+{
+   uint32_t rem = len % ADLER32_MODULO;
+   uint64_t sum1, sum2;
+
+   sum1 = (uint64_t) a->sum1 + b->sum1 + ADLER32_MODULO - 1;
+   sum2 = (uint64_t) rem * a->sum1 + a->sum2 + b->sum2 + ADLER32_MODULO - rem;
+
+   a->sum1 = sum1 % ADLER32_MODULO;
+   a->sum2 = sum2 % ADLER32_MODULO;
+}
+
+static uint32_t adler32_value(const struct adler32 *a)
+{
+   return a->sum1 | (a->sum2 << 16);
 }
 
 static uint32_t adler32_sum()
 {
-   return adler32.sum1 | (adler32.sum2 << 16);
+   return adler32_value(&adler32);
 }
 
 static uint32_t do_read_number(void)
@@ -175,8 +354,6 @@ static void (*write_zero_blocks)(size_t blks) = write_zero_blocks_;
 
 static void write_blocks(const u_char *buf, size_t blks)
 {
-   adler32_add(buf, blks);
-
    if (buf == zero_blk)
       write_zero_blocks(blks);
    else
@@ -207,12 +384,19 @@ static void do_extract_(void (*write_blocks)(const u_char *, size_t))
          } else
             num = BLK_SIZE;
          do_read(buf, num);
+         adler32_add(buf, 1);
          write_blocks(buf, 1);
          break;
       case 0x01:
          num = do_read_number();
+         adler32_add(zero_blk, num + 1);
          write_blocks(zero_blk, num + 1);
          break;
+      case 0x7e:
+         if (version < 3)
+            die("extract: corrupted image\n");
+         /* The index follows */
+         return;
       case 0x7f:
          do_read(buf, 4);
          num = buf[0] | buf[1] << 8 | buf[2] << 16 | buf[3] << 24;
@@ -230,143 +414,748 @@ static void do_extract(void)
    do_extract_(write_blocks);
 }
 
-static void do_write_number(uint32_t num)
+/* Encode a number, returning the number of bytes used */
+static size_t put_number(u_char *buf, uint32_t num)
 {
-   u_char buf[5], *b = buf;
-   size_t sz;
+   u_char *b = buf;
    do {
       *b = (u_char) (num & 0x7f);
    } while ((num >>= 7) && (*(b++) |= 0x80));
-   sz = b - buf + 1;
-   do_write(buf, sz);
+   return b - buf + 1;
 }
 
 enum block_type {
-   none,
    zero,
    raw,
 };
 
-static enum block_type detect_block_type(const u_char *buf)
+static int is_zero_block_generic(const u_char *buf)
 {
    int i;
 
-   if (buf == NULL)
-      return none;
-
    for (i = 0; i < BLK_SIZE / 8; i++)
       if (((uint64_t *)buf)[i])
-         return raw;
+         return 0;
+
+   return 1;
+}
+
+#ifdef X86_SIMD
+/* Blocks are checked 64 bytes at a time, so that data is found early */
+__attribute__((target("sse2")))
+static int is_zero_block_sse2(const u_char *buf)
+{
+   const __m128i *p = (const __m128i *) buf;
+   __m128i v;
+   int i;
 
-   return zero;
+   for (i = 0; i < BLK_SIZE / 16; i += 4) {
+      v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p + i),
+                                    _mm_loadu_si128(p + i + 1)),
+                       _mm_or_si128(_mm_loadu_si128(p + i + 2),
+                                    _mm_loadu_si128(p + i + 3)));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+         return 0;
+   }
+
+   return 1;
 }
 
-static void end_consecutive_blocks(enum block_type type, uint32_t blks)
+__attribute__((target("avx2")))
+static int is_zero_block_avx2(const u_char *buf)
 {
-   if (type == zero) {
-      do_write("\1", 1);
-      do_write_number(blks - 1);
+   const __m256i *p = (const __m256i *) buf;
+   __m256i v;
+   int i;
+
+   for (i = 0; i < BLK_SIZE / 32; i += 2) {
+      v = _mm256_or_si256(_mm256_loadu_si256(p + i),
+                          _mm256_loadu_si256(p + i + 1));
+      if (!_mm256_testz_si256(v, v))
+         return 0;
    }
+
+   return 1;
+}
+#endif
+
+static int (*is_zero_block)(const u_char *buf) = is_zero_block_generic;
+
+/* Use the best kernels the CPU supports */
+static void init_kernels(void)
+{
+#ifdef X86_SIMD
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2")) {
+      adler32_kernel = adler32_avx2;
+      is_zero_block = is_zero_block_avx2;
+   } else if (__builtin_cpu_supports("sse2")) {
+      adler32_kernel = adler32_sse2;
+      is_zero_block = is_zero_block_sse2;
+   }
+#endif
+}
+
+static enum block_type detect_block_type(const u_char *buf)
+{
+   return is_zero_block(buf) ? zero : raw;
+}
+
+/* Whether the image being created is indexed */
+static int indexed = 0;
+
+struct index_entry {
+   uint64_t blk;
+   uint64_t pos;
+};
+
+/* Append an entry to a growable array of index entries */
+static void add_index_entry(struct index_entry **entries, size_t *count,
+                            size_t *size, uint64_t blk, uint64_t pos)
+{
+   if (*count == *size) {
+      *size = *size ? *size * 2 : 256;
+      *entries = realloc(*entries, *size * sizeof(struct index_entry));
+      if (!*entries)
+         die("Unable to allocate memory\n");
+   }
+
+   (*entries)[*count].blk = blk;
+   (*entries)[*count].pos = pos;
+   (*count)++;
+}
+
+static struct {
+   struct index_entry *entries;
+   size_t count, size;
+   uint64_t sequences;
+} img_index;
+
+/* Record a sequence starting at the given block and image offset */
+static void index_sequence(uint64_t blk, uint64_t pos)
+{
+   if (img_index.sequences++ % INDEX_INTERVAL)
+      return;
+
+   add_index_entry(&img_index.entries, &img_index.count, &img_index.size,
+                   blk, pos);
+}
+
+/* Number of blocks written to the image so far */
+static uint64_t written_blks = 0;
+
+/* Write the index and the trailer ending an indexed image */
+static void write_index(void)
+{
+   u_char buf[24];
+   uint64_t index_pos = out_pos;
+   size_t i;
+
+   do_write("\x7e", 1);
+
+   for (i = 0; i < img_index.count; i++) {
+      write_le64(buf, 0, img_index.entries[i].blk);
+      write_le64(buf, 8, img_index.entries[i].pos);
+      do_write(buf, 16);
+   }
+
+   write_le64(buf, 0, index_pos);
+   write_le64(buf, 8, img_index.count);
+   write_le64(buf, 16, written_blks);
+   do_write(buf, 24);
+
+   free(img_index.entries);
 }
 
 static void do_init_image(void)
 {
    const u_char const buf[8] =
-      { 'V', 'M', 'F', 'S', 'I', 'M', 'G', FORMAT_VERSION };
+      { 'V', 'M', 'F', 'S', 'I', 'M', 'G',
+        indexed ? FORMAT_VERSION : NOINDEX_FORMAT_VERSION };
    do_write(buf, 8);
 }
 
-static void import_blocks(const u_char *buf, size_t blks)
+/*
+ * Images are created by a pipeline: the thread calling import_blocks()
+ * fills chunks of blocks, which compression threads encode independently,
+ * and a writer thread outputs them in order. Zero runs crossing chunk
+ * boundaries are merged by the writer, and the Adler-32 checksums of the
+ * chunks are combined, so that the result is the same as when processing
+ * blocks one after the other.
+ */
+
+/* Number of blocks in a chunk */
+#define CHUNK_BLKS 2048
+
+enum chunk_state {
+   chunk_free,
+   chunk_filled,
+   chunk_compressing,
+   chunk_compressed,
+};
+
+struct chunk {
+   enum chunk_state state;
+   u_char *buf;
+   uint64_t blks;
+   int zeroed;                 /* Zero blocks only, buf is not used */
+
+   /* Compressed data, preceded and followed by zero blocks */
+   u_char *out;
+   size_t out_len;
+   uint64_t lead, trail;
+   struct adler32 sum;
+
+   /* Sequences in the compressed data, when indexing */
+   struct index_entry *seqs;
+   size_t seq_count, seq_size;
+};
+
+/* Number of compression threads */
+#define MAX_THREADS 256
+static u_int num_threads = 0;
+
+static struct {
+   struct chunk *chunks;
+   u_int count;
+   struct chunk *current;      /* Chunk being filled */
+   uint64_t filled, compressing, written;
+   int finished;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   pthread_t *threads, writer;
+} pipeline;
+
+/* Compress a chunk */
+static void compress_chunk(struct chunk *c)
 {
-   static enum block_type last = none, current;
-   static uint32_t consecutive = 0;
+   const u_char *buf = c->buf;
+   u_char *out = c->out;
+   uint64_t i, zeroes = 0;
+   int words;
 
-   do {
-      current = detect_block_type(buf);
-      if ((last != none) && (current != last)) {
-         end_consecutive_blocks(last, consecutive);
-         consecutive = 0;
+   c->sum.sum1 = 1;
+   c->sum.sum2 = 0;
+   c->seq_count = 0;
+   c->lead = c->trail = 0;
+   c->out_len = 0;
+
+   if (c->zeroed) {
+      c->sum.sum2 = (c->blks * BLK_SIZE) % ADLER32_MODULO;
+      c->lead = c->blks;
+      return;
+   }
+
+   adler32_update(&c->sum, buf, c->blks);
+
+   for (i = 0; i < c->blks; i++, buf += BLK_SIZE) {
+      if (detect_block_type(buf) == zero) {
+         zeroes++;
+         continue;
       }
-      last = current;
-      switch (current) {
-      case zero:
-         if (buf == zero_blk) {
-            if (consecutive > (uint32_t) -blks)
-               end_consecutive_blocks(zero, (uint32_t) -1);
-            adler32_add(zero_blk, blks);
-            consecutive += blks;
-            return;
-         }
-         adler32_add(zero_blk, 1);
-         consecutive++;
-         break;
-      case raw:
-         do {
-            int i;
-            for (i = BLK_SIZE / 4; i;i--)
-               if (((uint32_t *)buf)[i - 1])
-                  break;
-            do_write("\0", 1);
-            do_write_number(i);
-            do_write(buf, i * 4);
-            adler32_add(buf, 1);
-         } while(0);
+
+      if (out == c->out)
+         c->lead = zeroes;
+      else if (zeroes) {
+         if (indexed)
+            add_index_entry(&c->seqs, &c->seq_count, &c->seq_size,
+                            i - zeroes, out - c->out);
+         *out++ = 0x01;
+         out += put_number(out, zeroes - 1);
+      }
+      zeroes = 0;
+
+      for (words = BLK_SIZE / 4; words; words--)
+         if (((uint32_t *)buf)[words - 1])
+            break;
+      if (indexed)
+         add_index_entry(&c->seqs, &c->seq_count, &c->seq_size,
+                         i, out - c->out);
+      *out++ = 0x00;
+      out += put_number(out, words);
+      memcpy(out, buf, words * 4);
+      out += words * 4;
+   }
+
+   if (out == c->out)
+      c->lead = zeroes;
+   else
+      c->trail = zeroes;
+   c->out_len = out - c->out;
+}
+
+/* Checksum of the blocks written to the image so far */
+static struct adler32 image_adler32 = { 1, 0 };
+
+/* Zero blocks following the last written sequence */
+static uint64_t pending_zeroes = 0;
+
+/* Write pending zero blocks */
+static void write_zero_run(void)
+{
+   u_char buf[6];
+   uint32_t num;
+
+   while (pending_zeroes) {
+      /* Keep num + 1 within 32 bits */
+      num = (pending_zeroes > 0xffffffff) ? 0xfffffffe : pending_zeroes - 1;
+      if (indexed)
+         index_sequence(written_blks, out_pos);
+      buf[0] = 0x01;
+      do_write(buf, 1 + put_number(&buf[1], num));
+      written_blks += (uint64_t) num + 1;
+      pending_zeroes -= (uint64_t) num + 1;
+   }
+}
+
+/* Write a compressed chunk */
+static void write_chunk(struct chunk *c)
+{
+   size_t i;
+
+   pending_zeroes += c->lead;
+   if (c->out_len) {
+      write_zero_run();
+      if (indexed)
+         for (i = 0; i < c->seq_count; i++)
+            index_sequence(written_blks - c->lead + c->seqs[i].blk,
+                           out_pos + c->seqs[i].pos);
+      do_write(c->out, c->out_len);
+      written_blks += c->blks - c->lead - c->trail;
+      pending_zeroes = c->trail;
+   }
+   adler32_combine(&image_adler32, &c->sum, c->blks * BLK_SIZE);
+}
+
+static void *compress_thread(void *arg)
+{
+   struct chunk *c;
+
+   pthread_mutex_lock(&pipeline.lock);
+   for (;;) {
+      while ((pipeline.compressing == pipeline.filled) && !pipeline.finished)
+         pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+      if (pipeline.compressing == pipeline.filled)
          break;
-      case none:
-         do {
-            uint32_t sum = adler32_sum();
-            u_char b[5] = { 0x7f, sum & 0xff, (sum >> 8) & 0xff,
-                            (sum >> 16) & 0xff, (sum >> 24) & 0xff };
-            do_write(b, 5);
-         } while(0);
-         return;
+
+      c = &pipeline.chunks[pipeline.compressing++ % pipeline.count];
+      c->state = chunk_compressing;
+      pthread_mutex_unlock(&pipeline.lock);
+
+      compress_chunk(c);
+
+      pthread_mutex_lock(&pipeline.lock);
+      c->state = chunk_compressed;
+      pthread_cond_broadcast(&pipeline.cond);
+   }
+   pthread_mutex_unlock(&pipeline.lock);
+   return NULL;
+}
+
+static void *write_thread(void *arg)
+{
+   struct chunk *c;
+
+   pthread_mutex_lock(&pipeline.lock);
+   for (;;) {
+      c = &pipeline.chunks[pipeline.written % pipeline.count];
+      while (c->state != chunk_compressed) {
+         if (pipeline.finished && (pipeline.written == pipeline.filled))
+            goto out;
+         pthread_cond_wait(&pipeline.cond, &pipeline.lock);
       }
-      buf += BLK_SIZE;
-   } while (--blks);
+      pthread_mutex_unlock(&pipeline.lock);
+
+      write_chunk(c);
+
+      pthread_mutex_lock(&pipeline.lock);
+      c->state = chunk_free;
+      pipeline.written++;
+      pthread_cond_broadcast(&pipeline.cond);
+   }
+out:
+   pthread_mutex_unlock(&pipeline.lock);
+   return NULL;
 }
 
-static void do_import(void)
+static void start_pipeline(void)
+{
+   u_int i;
+
+   if (!num_threads) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      num_threads = (cpus > 0) ? cpus : 1;
+   }
+
+   pipeline.count = num_threads * 2 + 2;
+   if (!(pipeline.chunks = calloc(pipeline.count, sizeof(struct chunk))) ||
+       !(pipeline.threads = calloc(num_threads, sizeof(pthread_t))))
+      die("Unable to allocate memory\n");
+
+   for (i = 0; i < pipeline.count; i++) {
+      pipeline.chunks[i].buf = malloc(CHUNK_BLKS * BLK_SIZE);
+      pipeline.chunks[i].out = malloc(CHUNK_BLKS * (BLK_SIZE + 8));
+      if (!pipeline.chunks[i].buf || !pipeline.chunks[i].out)
+         die("Unable to allocate memory\n");
+   }
+
+   pthread_mutex_init(&pipeline.lock, NULL);
+   pthread_cond_init(&pipeline.cond, NULL);
+
+   for (i = 0; i < num_threads; i++)
+      if (pthread_create(&pipeline.threads[i], NULL, compress_thread, NULL))
+         die("Unable to create thread\n");
+   if (pthread_create(&pipeline.writer, NULL, write_thread, NULL))
+      die("Unable to create thread\n");
+}
+
+static void stop_pipeline(void)
+{
+   u_int i;
+
+   pthread_mutex_lock(&pipeline.lock);
+   pipeline.finished = 1;
+   pthread_cond_broadcast(&pipeline.cond);
+   pthread_mutex_unlock(&pipeline.lock);
+
+   for (i = 0; i < num_threads; i++)
+      pthread_join(pipeline.threads[i], NULL);
+   pthread_join(pipeline.writer, NULL);
+
+   for (i = 0; i < pipeline.count; i++) {
+      free(pipeline.chunks[i].buf);
+      free(pipeline.chunks[i].out);
+      free(pipeline.chunks[i].seqs);
+   }
+   free(pipeline.chunks);
+   free(pipeline.threads);
+}
+
+/* Get the chunk being filled, waiting for a free one if needed */
+static struct chunk *get_chunk(void)
 {
-   u_char buf[BLK_SIZE * 16];
+   struct chunk *c;
+
+   if (pipeline.current)
+      return pipeline.current;
+
+   c = &pipeline.chunks[pipeline.filled % pipeline.count];
+   pthread_mutex_lock(&pipeline.lock);
+   while (c->state != chunk_free)
+      pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+   pthread_mutex_unlock(&pipeline.lock);
+
+   c->blks = 0;
+   c->zeroed = 0;
+   return pipeline.current = c;
+}
+
+/* Hand the chunk being filled over to compression threads */
+static void submit_chunk(void)
+{
+   struct chunk *c = pipeline.current;
+
+   if (!c)
+      return;
+
+   pthread_mutex_lock(&pipeline.lock);
+   c->state = chunk_filled;
+   pipeline.filled++;
+   pthread_cond_broadcast(&pipeline.cond);
+   pthread_mutex_unlock(&pipeline.lock);
+
+   pipeline.current = NULL;
+}
+
+static void import_blocks(const u_char *buf, size_t blks)
+{
+   struct chunk *c;
    size_t len;
-#ifdef __linux__
-   struct stat st;
-   int blocksize = 0;
-   off_t filesize = 0;
 
-   if ((fstat(0, &st) == 0) && S_ISREG(st.st_mode)) {
-      ioctl(0, FIGETBSZ, &blocksize);
-      filesize = st.st_size;
+   if (!pipeline.chunks)
+      start_pipeline();
+
+   if (buf == NULL) {
+      uint32_t sum;
+      u_char b[5];
+
+      submit_chunk();
+      stop_pipeline();
+      write_zero_run();
+
+      sum = adler32_value(&image_adler32);
+      b[0] = 0x7f;
+      b[1] = sum & 0xff;
+      b[2] = (sum >> 8) & 0xff;
+      b[3] = (sum >> 16) & 0xff;
+      b[4] = (sum >> 24) & 0xff;
+      do_write(b, 5);
+      if (indexed)
+         write_index();
+      return;
+   }
+
+   /* Long zero runs are given their own chunk, without data */
+   if ((buf == zero_blk) && (blks > CHUNK_BLKS)) {
+      submit_chunk();
+      c = get_chunk();
+      c->zeroed = 1;
+      c->blks = blks;
+      submit_chunk();
+      return;
+   }
+
+   while (blks) {
+      c = get_chunk();
+      len = CHUNK_BLKS - c->blks;
+      if (len > blks)
+         len = blks;
+      if (buf == zero_blk)
+         memset(c->buf + c->blks * BLK_SIZE, 0, len * BLK_SIZE);
+      else {
+         memcpy(c->buf + c->blks * BLK_SIZE, buf, len * BLK_SIZE);
+         buf += len * BLK_SIZE;
+      }
+      c->blks += len;
+      blks -= len;
+      if (c->blks == CHUNK_BLKS)
+         submit_chunk();
    }
+}
+
+/* Maximum number of blocks handed to import_blocks() at once */
+#define IMPORT_MAX_BLKS  0x10000000
+
+/* Size of the buffer used to read data to import */
+#define IMPORT_BUF_SIZE  0x100000
+
+/* Import zeroed blocks without reading them */
+static void import_zero_blocks(uint64_t blks)
+{
+   while (blks) {
+      size_t len = (blks > IMPORT_MAX_BLKS) ? IMPORT_MAX_BLKS : blks;
+      import_blocks(zero_blk, len);
+      blks -= len;
+   }
+}
+
+/* Import data read from stdin between the given offsets */
+static void import_data(u_char *buf, off_t pos, off_t end)
+{
+   size_t len;
+
+   if (lseek(0, pos, SEEK_SET) == -1)
+      die("Seek error\n");
+
+   while (pos < end) {
+      len = IMPORT_BUF_SIZE;
+      if (len > end - pos)
+         len = end - pos;
+      if (!(len = do_reads(buf, BLK_SIZE, len / BLK_SIZE)))
+         die("Unexpected end of file\n");
+      import_blocks(buf, len / BLK_SIZE);
+      pos += len;
+   }
+}
+
+/*
+ * Import stdin. When it is a regular file, only its data extents, as
+ * reported by SEEK_DATA and SEEK_HOLE, are read, and holes are imported as
+ * zeroes.
+ */
+static void do_import(void)
+{
+   u_char *buf;
+   size_t len;
+#ifdef SEEK_DATA
+   struct stat st;
+   off_t pos = 0, data, hole;
 #endif
 
+   if (!(buf = malloc(IMPORT_BUF_SIZE)))
+      die("Unable to allocate memory\n");
+
    do_init_image();
 
-#ifdef __linux__
-   if (blocksize) {
-      uint32_t i, max = filesize / blocksize;
-      for (i = 0; i < max; i++) {
-         uint32_t block = i;
-         if (ioctl(0, FIBMAP, &block) < 0)
-            goto fallback;
-         if (block) {
-            lseek(0, (off_t) i * blocksize, SEEK_SET);
-            len = do_reads(buf, BLK_SIZE, blocksize / BLK_SIZE);
-            import_blocks(buf, len / BLK_SIZE);
-         } else
-            import_blocks(zero_blk, blocksize / BLK_SIZE);
+#ifdef SEEK_DATA
+   if ((fstat(0, &st) == 0) && S_ISREG(st.st_mode) &&
+       ((lseek(0, 0, SEEK_DATA) != -1) || (errno == ENXIO))) {
+      while (pos < st.st_size) {
+         if ((data = lseek(0, pos, SEEK_DATA)) == -1) {
+            if (errno != ENXIO)
+               die("Seek error\n");
+            data = st.st_size;
+         }
+         /* Extents are rounded to whole blocks */
+         data &= ~(off_t) (BLK_SIZE - 1);
+         if (data < pos)
+            data = pos;
+         import_zero_blocks((data - pos) / BLK_SIZE);
+         if (data >= st.st_size)
+            break;
+
+         if ((hole = lseek(0, data, SEEK_HOLE)) == -1)
+            die("Seek error\n");
+         hole = ALIGN_NUM(hole, BLK_SIZE);
+         import_data(buf, data, hole);
+         pos = hole;
       }
-      if (filesize % blocksize)
-         import_blocks(zero_blk, (filesize % blocksize) / BLK_SIZE);
       import_blocks(NULL, 0);
+      free(buf);
       return;
    }
-fallback:
+   lseek(0, 0, SEEK_SET);
 #endif
-   while ((len = do_reads(buf, BLK_SIZE, 16)))
+   while ((len = do_reads(buf, BLK_SIZE, IMPORT_BUF_SIZE / BLK_SIZE)))
       import_blocks(buf, len / BLK_SIZE);
 
    import_blocks(NULL, 0);
+   free(buf);
+}
+
+static vmfs_file_t *vmfs_file;
+
+/*
+ * Import a file from a VMFS filesystem, following its block map. Holes and
+ * TBZ blocks are emitted as zero runs without touching the device. A
+ * trailing partial block is padded with zeroes.
+ */
+static void do_import_vmfs(void)
+{
+   uint64_t size = vmfs_file_get_size(vmfs_file);
+   vmfs_extent_t ext;
+   u_char *buf;
+   off_t pos = 0;
+
+   if (!(buf = iobuffer_alloc(IMPORT_BUF_SIZE)))
+      die("Unable to allocate memory\n");
+
+   do_init_image();
+
+   while (pos < size) {
+      uint64_t end;
+      int res;
+
+      if ((res = vmfs_file_get_extent(vmfs_file, pos, 0, &ext)) < 0)
+         die("Unable to get extent at 0x%"PRIx64": %s\n", (uint64_t) pos,
+             strerror(-res));
+
+      end = ext.pos + ext.len;
+      if (end > size)
+         end = size;
+
+      if (ext.type != VMFS_EXTENT_DATA) {
+         end = ALIGN_NUM(end, BLK_SIZE);
+         import_zero_blocks((end - pos) / BLK_SIZE);
+         pos = end;
+         continue;
+      }
+
+      while (pos < end) {
+         size_t len = IMPORT_BUF_SIZE;
+         ssize_t rlen;
+
+         if (len > end - pos)
+            len = end - pos;
+         if ((rlen = vmfs_file_pread(vmfs_file, buf, len, pos)) != len)
+            die("Read error at 0x%"PRIx64"\n", (uint64_t) pos);
+         if (len % BLK_SIZE) {
+            memset(buf + len, 0, BLK_SIZE - len % BLK_SIZE);
+            len = ALIGN_NUM(len, BLK_SIZE);
+         }
+         import_blocks(buf, len / BLK_SIZE);
+         pos += len;
+      }
+   }
+
+   import_blocks(NULL, 0);
+   iobuffer_free(buf);
+}
+
+/* State of an allocation-aware device import */
+struct import_device {
+   u_char *buf;
+   off_t pos;         /* Next device offset to import */
+   off_t data_start;  /* Device offset of the first block of the extent */
+   off_t lvm_start;   /* LVM offset of the first block of the extent */
+   off_t lvm_end;     /* LVM offset past the last block of the extent */
+   uint64_t blk_size;
+};
+
+/* Import device data from the current position up to the given offset */
+static void import_device_data(struct import_device *d, off_t end)
+{
+   if (d->pos < end)
+      import_data(d->buf, d->pos, end);
+   d->pos = end;
+}
+
+/* Import a run of free file blocks as zeroes, after the data preceding it */
+static void import_device_free_run(vmfs_bitmap_t *b, uint32_t addr,
+                                   uint32_t len, void *opt_arg)
+{
+   struct import_device *d = opt_arg;
+   off_t start = (off_t) addr * d->blk_size;
+   off_t end = start + (off_t) len * d->blk_size;
+
+   if (start < d->lvm_start)
+      start = d->lvm_start;
+   if (end > d->lvm_end)
+      end = d->lvm_end;
+   if (start >= end)
+      return;
+
+   start += d->data_start - d->lvm_start;
+   end += d->data_start - d->lvm_start;
+
+   import_device_data(d, start);
+   import_zero_blocks((end - start) / BLK_SIZE);
+   d->pos = end;
+}
+
+/*
+ * Import a whole VMFS device, skipping file blocks the file block bitmap
+ * reports as free. Everything else, including the volume headers and
+ * the system files, is read as usual.
+ */
+static void do_import_device(vmfs_fs_t *fs, const char *path)
+{
+   vmfs_lvm_t *lvm = (vmfs_lvm_t *)fs->dev;
+   vmfs_volume_t *vol = NULL;
+   struct import_device d;
+   off_t size;
+   int i;
+
+   for (i = 0; i < lvm->loaded_extents; i++)
+      if (!strcmp(lvm->extents[i]->device, path))
+         vol = lvm->extents[i];
+   if (!vol)
+      die("Unable to find extent %s\n", path);
+
+   /* Blocks are read from the raw device, not through the image reader */
+   if (vol->img)
+      die("%s is already an image\n", path);
+
+   if ((size = lseek(0, 0, SEEK_END)) == -1)
+      die("Seek error\n");
+
+   if (!(d.buf = iobuffer_alloc(IMPORT_BUF_SIZE)))
+      die("Unable to allocate memory\n");
+
+   d.pos = 0;
+   d.blk_size = vmfs_fs_get_blocksize(fs);
+   d.data_start = vol->vmfs_base + 0x1000000;
+   d.lvm_start = (off_t) vol->vol_info.first_segment * VMFS_LVM_SEGMENT_SIZE;
+   d.lvm_end = (off_t) (vol->vol_info.last_segment + 1) * VMFS_LVM_SEGMENT_SIZE;
+   if (d.lvm_end - d.lvm_start > size - d.data_start)
+      d.lvm_end = d.lvm_start + size - d.data_start;
+
+   do_init_image();
+   vmfs_bitmap_foreach_free_run(fs->fbb, import_device_free_run, &d);
+   import_device_data(&d, size);
+   import_blocks(NULL, 0);
+
+   iobuffer_free(d.buf);
 }
 
 static void do_reimport(void)
@@ -378,9 +1167,13 @@ static void do_reimport(void)
    import_blocks(NULL, 0);
 }
 
+static void discard_blocks(const u_char *buf, size_t blks)
+{
+}
+
 static void do_verify(void)
 {
-   do_extract_(adler32_add);
+   do_extract_(discard_blocks);
 }
 
 int main(int argc,char *argv[])
@@ -389,6 +1182,74 @@ int main(int argc,char *argv[])
    void (*func)(void) = do_import;
    struct stat st;
 
+   init_kernels();
+
+   for (;;) {
+      if ((argc > 1) && (strcmp(argv[1],"-i") == 0)) {
+         indexed = 1;
+      } else if ((argc > 2) && (strcmp(argv[1],"-j") == 0)) {
+         char *end;
+         long n = strtol(argv[2], &end, 10);
+         if ((end == argv[2]) || *end || (n < 1) || (n > MAX_THREADS)) {
+            show_usage(argv[0]);
+            return(1);
+         }
+         num_threads = n;
+         argv[2] = argv[0];
+         argv++;
+         argc--;
+      } else
+         break;
+      argv[1] = argv[0];
+      argv++;
+      argc--;
+   }
+
+   if ((argc > 2) && (strcmp(argv[1],"-a") == 0)) {
+      vmfs_flags_t flags;
+      vmfs_fs_t *fs;
+      int fd;
+
+      flags.packed = 0;
+      flags.allow_missing_extents = 1;
+
+      if (!(fs = vmfs_fs_open(&argv[2], flags)))
+         die("Unable to open filesystem\n");
+
+      if ((fd = open(argv[2], O_RDONLY)) == -1)
+         die("Error opening %s: %s\n", argv[2], strerror(errno));
+      dup2(fd,0);
+      close(fd);
+
+      do_import_device(fs, argv[2]);
+      vmfs_fs_close(fs);
+      return(0);
+   }
+
+   if ((argc > 3) && (strcmp(argv[1],"-f") == 0)) {
+      vmfs_flags_t flags;
+      vmfs_fs_t *fs;
+      vmfs_dir_t *root_dir;
+
+      flags.packed = 0;
+      flags.allow_missing_extents = 1;
+
+      if (!(fs = vmfs_fs_open(&argv[3], flags)))
+         die("Unable to open filesystem\n");
+
+      if (!(root_dir = vmfs_dir_open_from_blkid(fs,VMFS_BLK_FD_BUILD(0, 0, 0))))
+         die("Unable to open root directory\n");
+
+      if (!(vmfs_file = vmfs_file_open_at(root_dir, argv[2])))
+         die("Unable to open file %s\n", argv[2]);
+
+      vmfs_dir_close(root_dir);
+      do_import_vmfs();
+      vmfs_file_close(vmfs_file);
+      vmfs_fs_close(fs);
+      return(0);
+   }
+
    if (argc > 1) {
       if (strcmp(argv[1],"-x") == 0) {
          func = do_extract;
@@ -1,2 +1,4 @@
 utils.o_CFLAGS := $(if $(HAS_POSIX_MEMALIGN),,-DNO_POSIX_MEMALIGN=1)
+vmfs_file.o_CFLAGS := $(if $(HAS_SPLICE),,-DNO_SPLICE=1) $(if $(HAS_COPY_FILE_RANGE),,-DNO_COPY_FILE_RANGE=1)
 REQUIRES := uuid
+LDFLAGS := $(PTHREAD_CREATE_LDFLAGS)
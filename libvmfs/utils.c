@@ -124,12 +124,38 @@ char *m_fmode_to_str(u_int mode,char *buf)
 /* Count the number of bits set in a byte */
 int bit_count(u_char val)
 {
-   static int qb[16] = {
-      0, 1, 1, 2, 1, 2, 2, 3,
-      1, 2, 2, 3, 2, 3, 3, 4,
-   };
+   return(__builtin_popcount(val));
+}
+
+/* Count the number of bits set in a buffer */
+u_int bit_count_buf(const u_char *buf,size_t len)
+{
+   uint64_t val;
+   u_int count = 0;
+
+   /* Process 64-bit words, the compiler emits popcnt when available */
+   for(;len >= sizeof(val);buf+=sizeof(val),len-=sizeof(val)) {
+      memcpy(&val,buf,sizeof(val));
+      count += __builtin_popcountll(val);
+   }
 
-   return(qb[val >> 4] + qb[val & 0x0F]);
+   while(len--)
+      count += __builtin_popcount(*buf++);
+
+   return(count);
+}
+
+/* Initialize a mutex that may be locked several times by the same thread */
+int m_mutex_init_recursive(pthread_mutex_t *mutex)
+{
+   pthread_mutexattr_t attr;
+   int res;
+
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+   res = pthread_mutex_init(mutex,&attr);
+   pthread_mutexattr_destroy(&attr);
+   return(res);
 }
 
 /* Allocate a buffer with alignment compatible for direct I/O */
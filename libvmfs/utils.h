@@ -22,6 +22,7 @@
 #include <string.h>
 #include <uuid.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 /* Max and min macro */
 #define m_max(a,b) (((a) > (b)) ? (a) : (b))
@@ -160,6 +161,12 @@ char *m_fmode_to_str(u_int mode,char *buf);
 /* Count the number of bits set in a byte */
 int bit_count(u_char val);
 
+/* Count the number of bits set in a buffer */
+u_int bit_count_buf(const u_char *buf,size_t len);
+
+/* Initialize a mutex that may be locked several times by the same thread */
+int m_mutex_init_recursive(pthread_mutex_t *mutex);
+
 /* Allocate a buffer with alignment compatible for direct I/O */
 u_char *iobuffer_alloc(size_t len);
 
@@ -31,10 +31,15 @@ typedef struct vmfs_bitmap vmfs_bitmap_t;
 typedef struct vmfs_inode vmfs_inode_t;
 typedef struct vmfs_dirent vmfs_dirent_t;
 typedef struct vmfs_dir vmfs_dir_t;
+typedef struct vmfs_dir_cache vmfs_dir_cache_t;
+typedef struct vmfs_dentry vmfs_dentry_t;
 typedef struct vmfs_blk_array vmfs_blk_array_t;
 typedef struct vmfs_blk_list vmfs_blk_list_t;
 typedef struct vmfs_file vmfs_file_t;
+typedef struct vmfs_extent vmfs_extent_t;
+typedef struct vmfs_extract_job vmfs_extract_job_t;
 typedef struct vmfs_device vmfs_device_t;
+typedef struct vmfs_image vmfs_image_t;
 typedef struct vmfs_volume vmfs_volume_t;
 typedef struct vmfs_lvm vmfs_lvm_t;
 typedef struct vmfs_fs vmfs_fs_t;
@@ -59,9 +64,11 @@ typedef union vmfs_flags vmfs_flags_t __attribute__((transparent_union));
 #include "vmfs_dirent.h"
 #include "vmfs_file.h"
 #include "vmfs_device.h"
+#include "vmfs_image.h"
 #include "vmfs_volume.h"
 #include "vmfs_lvm.h"
 #include "vmfs_fs.h"
 #include "vmfs_host.h"
+#include "vmfs_extract.h"
 
 #endif
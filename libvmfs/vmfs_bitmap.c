@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/types.h>
 
 #include "utils.h"
@@ -346,23 +347,31 @@ int vmfs_bitmap_find_free_items(vmfs_bitmap_t *b,u_int num_items,
 /* Count the total number of allocated items in a bitmap area */
 uint32_t vmfs_bitmap_area_allocated_items(vmfs_bitmap_t *b,u_int area)
 {
-   u_char buf[VMFS_BITMAP_ENTRY_SIZE];
    vmfs_bitmap_entry_t entry;
    uint32_t count;
+   u_char *buf;
+   size_t buf_len;
    off_t pos;
    int i;
 
    pos = vmfs_bitmap_get_area_addr(&b->bmh,area);
+   buf_len = b->bmh.bmp_entries_per_area * VMFS_BITMAP_ENTRY_SIZE;
 
-   for(i=0,count=0;i<b->bmh.bmp_entries_per_area;i++) {
-      if (vmfs_file_pread(b->f,buf,sizeof(buf),pos) != sizeof(buf))
-         break;
+   /* Read all the entries of the area at once */
+   if (!(buf = iobuffer_alloc(buf_len)))
+      return(0);
+
+   if (vmfs_file_pread(b->f,buf,buf_len,pos) != buf_len) {
+      iobuffer_free(buf);
+      return(0);
+   }
 
-      vmfs_bme_read(&entry,buf,0);
+   for(i=0,count=0;i<b->bmh.bmp_entries_per_area;i++) {
+      vmfs_bme_read(&entry,buf + (i * VMFS_BITMAP_ENTRY_SIZE),0);
       count += entry.total - entry.free;
-      pos += sizeof(buf);
    }
 
+   iobuffer_free(buf);
    return count;
 }
 
@@ -383,20 +392,28 @@ void vmfs_bitmap_area_foreach(vmfs_bitmap_t *b,u_int area,
                               vmfs_bitmap_foreach_cbk_t cbk,
                               void *opt_arg)
 {
-   DECL_ALIGNED_BUFFER(buf,VMFS_BITMAP_ENTRY_SIZE);
    vmfs_bitmap_entry_t entry;
+   u_char *buf;
+   size_t buf_len;
    off_t pos;
    uint32_t addr;
    u_int array_idx,bit_idx;
    u_int i,j;
 
    pos = vmfs_bitmap_get_area_addr(&b->bmh,area);
+   buf_len = b->bmh.bmp_entries_per_area * VMFS_BITMAP_ENTRY_SIZE;
 
-   for(i=0;i<b->bmh.bmp_entries_per_area;i++) {
-      if (vmfs_file_pread(b->f,buf,buf_len,pos) != buf_len)
-         break;
+   /* Read all the entries of the area at once */
+   if (!(buf = iobuffer_alloc(buf_len)))
+      return;
 
-      vmfs_bme_read(&entry,buf,1);
+   if (vmfs_file_pread(b->f,buf,buf_len,pos) != buf_len) {
+      iobuffer_free(buf);
+      return;
+   }
+
+   for(i=0;i<b->bmh.bmp_entries_per_area;i++) {
+      vmfs_bme_read(&entry,buf + (i * VMFS_BITMAP_ENTRY_SIZE),1);
 
       for(j=0;j<entry.total;j++) {
          array_idx = j >> 3;
@@ -409,9 +426,9 @@ void vmfs_bitmap_area_foreach(vmfs_bitmap_t *b,u_int area,
          if (!(entry.bitmap[array_idx] & (1 << bit_idx)))
             cbk(b,addr,opt_arg);
       }
-
-      pos += buf_len;
    }
+
+   iobuffer_free(buf);
 }
 
 /* Call a user function for each allocated item in a bitmap */
@@ -424,17 +441,179 @@ void vmfs_bitmap_foreach(vmfs_bitmap_t *b,vmfs_bitmap_foreach_cbk_t cbk,
       vmfs_bitmap_area_foreach(b,i,cbk,opt_arg);
 }
 
+/* Shared state for parallel bitmap traversal */
+struct vmfs_bitmap_foreach_job {
+   vmfs_bitmap_t *b;
+   vmfs_bitmap_foreach_cbk_t cbk;
+   void *opt_arg;
+   pthread_mutex_t lock;
+   u_int next_area;
+};
+
+/* Worker thread: process areas until there are none left */
+static void *vmfs_bitmap_foreach_worker(void *arg)
+{
+   struct vmfs_bitmap_foreach_job *job = arg;
+   u_int area;
+
+   for(;;) {
+      pthread_mutex_lock(&job->lock);
+      area = job->next_area++;
+      pthread_mutex_unlock(&job->lock);
+
+      if (area >= job->b->bmh.area_count)
+         break;
+
+      vmfs_bitmap_area_foreach(job->b,area,job->cbk,job->opt_arg);
+   }
+
+   return NULL;
+}
+
+/* 
+ * Call a user function for each allocated item in a bitmap, processing
+ * areas in parallel with the given number of threads. The callback must
+ * be thread-safe. Items are reported in order within an area, but areas
+ * are processed in no particular order.
+ */
+void vmfs_bitmap_foreach_mt(vmfs_bitmap_t *b,u_int num_threads,
+                            vmfs_bitmap_foreach_cbk_t cbk,void *opt_arg)
+{
+   struct vmfs_bitmap_foreach_job job;
+   pthread_t *threads;
+   u_int i,started;
+
+   num_threads = m_min(num_threads,b->bmh.area_count);
+
+   if ((num_threads <= 1) || !(threads = calloc(num_threads,sizeof(*threads))))
+   {
+      vmfs_bitmap_foreach(b,cbk,opt_arg);
+      return;
+   }
+
+   job.b         = b;
+   job.cbk       = cbk;
+   job.opt_arg   = opt_arg;
+   job.next_area = 0;
+   pthread_mutex_init(&job.lock,NULL);
+
+   for(started=0;started<num_threads;started++)
+      if (pthread_create(&threads[started],NULL,
+                         vmfs_bitmap_foreach_worker,&job))
+         break;
+
+   /* Make sure all areas get processed, even without any worker */
+   if (!started)
+      vmfs_bitmap_foreach_worker(&job);
+
+   for(i=0;i<started;i++)
+      pthread_join(threads[i],NULL);
+
+   pthread_mutex_destroy(&job.lock);
+   free(threads);
+}
+
+/* State of the free run scanner */
+struct vmfs_bitmap_run {
+   uint32_t start,len;
+   vmfs_bitmap_run_cbk_t cbk;
+   void *opt_arg;
+};
+
+/* Add free items to the current run, reporting it when it ends */
+static inline void vmfs_bitmap_run_add(vmfs_bitmap_t *b,
+                                       struct vmfs_bitmap_run *run,
+                                       uint32_t addr,uint32_t len)
+{
+   if (run->len && (run->start + run->len == addr)) {
+      run->len += len;
+      return;
+   }
+
+   if (run->len)
+      run->cbk(b,run->start,run->len,run->opt_arg);
+
+   run->start = addr;
+   run->len   = len;
+}
+
+/* 
+ * Call a user function for each run of contiguous free items in a bitmap.
+ * Areas are read with a single I/O and entries are scanned 64 bits at a
+ * time, so that fully allocated or fully free words are skipped at once.
+ */
+void vmfs_bitmap_foreach_free_run(vmfs_bitmap_t *b,vmfs_bitmap_run_cbk_t cbk,
+                                  void *opt_arg)
+{
+   struct vmfs_bitmap_run run = { 0, 0, cbk, opt_arg };
+   vmfs_bitmap_entry_t entry;
+   u_char *buf;
+   size_t buf_len;
+   uint32_t addr;
+   uint64_t word,mask;
+   u_int area,i,k,nbits,pos,len;
+
+   buf_len = b->bmh.bmp_entries_per_area * VMFS_BITMAP_ENTRY_SIZE;
+
+   if (!(buf = iobuffer_alloc(buf_len)))
+      return;
+
+   for(area=0;area<b->bmh.area_count;area++) {
+      if (vmfs_file_pread(b->f,buf,buf_len,
+                          vmfs_bitmap_get_area_addr(&b->bmh,area)) != buf_len)
+         break;
+
+      for(i=0;i<b->bmh.bmp_entries_per_area;i++) {
+         vmfs_bme_read(&entry,buf + (i * VMFS_BITMAP_ENTRY_SIZE),1);
+
+         addr =  area * vmfs_bitmap_get_items_per_area(&b->bmh);
+         addr += i * b->bmh.items_per_bitmap_entry;
+
+         entry.total = m_min(entry.total,sizeof(entry.bitmap) * 8);
+
+         for(k=0;k<entry.total;k+=64,addr+=64) {
+            nbits = m_min(entry.total - k,64);
+            mask  = (nbits == 64) ? ~0ULL : ((1ULL << nbits) - 1);
+            word  = read_le64(entry.bitmap,k >> 3) & mask;
+
+            /* Free bits are set: full words extend the run at once */
+            if (word == mask) {
+               vmfs_bitmap_run_add(b,&run,addr,nbits);
+               continue;
+            }
+
+            /* Otherwise, skip allocated bits and count free ones */
+            for(pos=0;word;pos+=len,word>>=len) {
+               len = __builtin_ctzll(word);
+               pos += len;
+               word >>= len;
+
+               /* Bits above nbits are cleared, so ~word can't be 0 */
+               len = __builtin_ctzll(~word);
+               vmfs_bitmap_run_add(b,&run,addr+pos,len);
+            }
+         }
+      }
+   }
+
+   if (run.len)
+      cbk(b,run.start,run.len,opt_arg);
+
+   iobuffer_free(buf);
+}
+
 /* Check coherency of a bitmap file */
 int vmfs_bitmap_check(vmfs_bitmap_t *b)
 {  
-   u_char buf[VMFS_BITMAP_ENTRY_SIZE];
    vmfs_bitmap_entry_t entry;
    uint32_t total_items;
    uint32_t magic;
    uint32_t entry_id;
-   int i,j,k,errors;
+   int i,j,errors;
    int bmap_size;
    int bmap_count;
+   u_char *buf,*ptr;
+   size_t buf_len;
    off_t pos;
 
    errors      = 0;
@@ -442,14 +621,23 @@ int vmfs_bitmap_check(vmfs_bitmap_t *b)
    magic       = 0;
    entry_id    = 0;
 
+   buf_len = b->bmh.bmp_entries_per_area * VMFS_BITMAP_ENTRY_SIZE;
+
+   if (!(buf = iobuffer_alloc(buf_len))) {
+      printf("Unable to allocate memory to check the bitmap\n");
+      return(1);
+   }
+
    for(i=0;i<b->bmh.area_count;i++) {
       pos = vmfs_bitmap_get_area_addr(&b->bmh,i);
 
-      for(j=0;j<b->bmh.bmp_entries_per_area;j++) {
-         if (vmfs_file_pread(b->f,buf,sizeof(buf),pos) != sizeof(buf))
-            break;
+      /* Read all the entries of the area at once */
+      if (vmfs_file_pread(b->f,buf,buf_len,pos) != buf_len)
+         continue;
 
-         vmfs_bme_read(&entry,buf,0);
+      for(j=0;j<b->bmh.bmp_entries_per_area;j++) {
+         ptr = buf + (j * VMFS_BITMAP_ENTRY_SIZE);
+         vmfs_bme_read(&entry,ptr,0);
 
          if (entry.mdh.magic == 0)
             goto done;
@@ -479,12 +667,9 @@ int vmfs_bitmap_check(vmfs_bitmap_t *b)
          }
 
          /* check the bitmap array */
-         bmap_size = (entry.total + 7) / 8;
-         bmap_count = 0;
-
-         for(k=0;k<bmap_size;k++) {
-            bmap_count += bit_count(buf[VMFS_BME_OFS_BITMAP+k]);
-         }
+         bmap_size = m_min((entry.total + 7) / 8,
+                           VMFS_BITMAP_ENTRY_SIZE - VMFS_BME_OFS_BITMAP);
+         bmap_count = bit_count_buf(ptr + VMFS_BME_OFS_BITMAP,bmap_size);
 
          if (bmap_count != entry.free) {
             printf("Entry 0x%x has an incorrect bitmap array "
@@ -495,11 +680,12 @@ int vmfs_bitmap_check(vmfs_bitmap_t *b)
 
          total_items += entry.total;
          entry_id++;
-         pos += sizeof(buf);
       }
    }
 
  done:
+   iobuffer_free(buf);
+
    if (total_items != b->bmh.total_items) {
       printf("Total number of items (0x%x) doesn't match header info (0x%x)\n",
              total_items,b->bmh.total_items);
@@ -138,6 +138,18 @@ void vmfs_bitmap_area_foreach(vmfs_bitmap_t *b,u_int area,
 void vmfs_bitmap_foreach(vmfs_bitmap_t *b,vmfs_bitmap_foreach_cbk_t cbk,
                          void *opt_arg);
 
+/* Same as vmfs_bitmap_foreach(), using several threads (thread-safe cbk) */
+void vmfs_bitmap_foreach_mt(vmfs_bitmap_t *b,u_int num_threads,
+                            vmfs_bitmap_foreach_cbk_t cbk,void *opt_arg);
+
+/* Callback prototype for vmfs_bitmap_foreach_free_run() */
+typedef void (*vmfs_bitmap_run_cbk_t)(vmfs_bitmap_t *b,uint32_t addr,
+                                      uint32_t len,void *opt_arg);
+
+/* Call a user function for each run of contiguous free items in a bitmap */
+void vmfs_bitmap_foreach_free_run(vmfs_bitmap_t *b,vmfs_bitmap_run_cbk_t cbk,
+                                  void *opt_arg);
+
 /* Check coherency of a bitmap file */
 int vmfs_bitmap_check(vmfs_bitmap_t *b);
 
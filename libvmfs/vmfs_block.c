@@ -94,41 +94,138 @@ int vmfs_block_get_status(const vmfs_fs_t *fs,uint32_t blk_id)
    return(vmfs_bitmap_get_item_status(&bmp->bmh,&entry,info.entry,info.item));
 }
 
-/* Allocate or free the specified block */
-static int vmfs_block_set_status(const vmfs_fs_t *fs,uint32_t blk_id,
-                                 int status)
+/* 
+ * Compare two block IDs by bitmap type, entry and item. Invalid IDs are
+ * sorted last, by value.
+ */
+int vmfs_block_cmp(const void *a,const void *b)
+{
+   uint32_t blk_a = *(const uint32_t *)a, blk_b = *(const uint32_t *)b;
+   vmfs_block_info_t ia,ib;
+   int va,vb;
+
+   va = (vmfs_block_get_info(blk_a,&ia) != -1);
+   vb = (vmfs_block_get_info(blk_b,&ib) != -1);
+
+   if (!va || !vb) {
+      if (va != vb)
+         return(va ? -1 : 1);
+      if (blk_a != blk_b)
+         return((blk_a < blk_b) ? -1 : 1);
+      return(0);
+   }
+
+   if (ia.type != ib.type)
+      return((ia.type < ib.type) ? -1 : 1);
+
+   if (ia.entry != ib.entry)
+      return((ia.entry < ib.entry) ? -1 : 1);
+
+   if (ia.item != ib.item)
+      return((ia.item < ib.item) ? -1 : 1);
+
+   return(0);
+}
+
+/* Get the number of the bitmap entry holding a block */
+static inline uint32_t vmfs_block_bme_num(const vmfs_bitmap_t *bmp,
+                                          const vmfs_block_info_t *info)
+{
+   return(info->entry + (info->item / bmp->bmh.items_per_bitmap_entry));
+}
+
+/* 
+ * Allocate or free a list of blocks. The list is sorted in place so that
+ * blocks sharing a bitmap entry are handled with a single lock and a
+ * single entry update. Returns the number of blocks whose status changed.
+ * The allocator lock must be held.
+ */
+static int vmfs_block_set_status_list_locked(const vmfs_fs_t *fs,
+                                             uint32_t *blk_ids,
+                                             u_int count,int status)
 {
    DECL_ALIGNED_BUFFER(buf,VMFS_BITMAP_ENTRY_SIZE);
    vmfs_bitmap_entry_t entry;
    vmfs_bitmap_t *bmp;
    vmfs_block_info_t info;
+   uint32_t bme_num;
+   u_int i,j,changed;
+   int res = 0;
 
-   if (vmfs_block_get_info(blk_id,&info) == -1)
-      return(-1);
+   if (count > 1)
+      qsort(blk_ids,count,sizeof(uint32_t),vmfs_block_cmp);
 
-   if (!(bmp = vmfs_fs_get_bitmap(fs, info.type)))
-      return(-1);
+   for(i=0;i<count;i=j) {
+      j = i + 1;
 
-   if (vmfs_bitmap_get_entry(bmp,info.entry,info.item,&entry) == -1)
-      return(-1);
+      if ((vmfs_block_get_info(blk_ids[i],&info) == -1) ||
+          !(bmp = vmfs_fs_get_bitmap(fs,info.type)))
+         continue;
 
-   /* Lock the bitmap entry to ensure exclusive access */
-   if (!vmfs_metadata_lock((vmfs_fs_t *)fs,entry.mdh.pos,
-                           buf,buf_len,&entry.mdh) == -1)
-      return(-1);
+      bme_num = vmfs_block_bme_num(bmp,&info);
+
+      if (vmfs_bitmap_get_entry(bmp,info.entry,info.item,&entry) == -1)
+         return(-1);
+
+      /* Lock the bitmap entry to ensure exclusive access */
+      if (vmfs_metadata_lock((vmfs_fs_t *)fs,entry.mdh.pos,
+                             buf,buf_len,&entry.mdh) == -1)
+         return(-1);
+
+      /* Use the entry content read with the lock taken */
+      vmfs_bme_read(&entry,buf,1);
+
+      /* Flip the status of all the items belonging to this entry */
+      changed = 0;
+
+      if (!vmfs_bitmap_set_item_status(&bmp->bmh,&entry,
+                                       info.entry,info.item,status))
+         changed++;
+
+      for(;j<count;j++) {
+         vmfs_block_info_t next;
+
+         if ((vmfs_block_get_info(blk_ids[j],&next) == -1) ||
+             (next.type != info.type) ||
+             (vmfs_block_bme_num(bmp,&next) != bme_num))
+            break;
+
+         if (!vmfs_bitmap_set_item_status(&bmp->bmh,&entry,
+                                          next.entry,next.item,status))
+            changed++;
+      }
+
+      /* Update entry and release lock */
+      if (changed)
+         vmfs_bme_update(fs,&entry);
 
-   /* Mark the item as allocated */
-   if (vmfs_bitmap_set_item_status(&bmp->bmh,&entry,
-                                   info.entry,info.item,status) == -1)
-   {
       vmfs_metadata_unlock((vmfs_fs_t *)fs,&entry.mdh);
-      return(-1);
+      vmfs_fs_update_allocated_items(fs,info.type,
+                                     status ? changed : -(int)changed);
+      res += changed;
    }
 
-   /* Update entry and release lock */
-   vmfs_bme_update(fs,&entry);
-   vmfs_metadata_unlock((vmfs_fs_t *)fs,&entry.mdh);
-   return(0);
+   return(res);
+}
+
+/* Allocate or free a list of blocks */
+static int vmfs_block_set_status_list(const vmfs_fs_t *fs,uint32_t *blk_ids,
+                                      u_int count,int status)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+   int res;
+
+   pthread_mutex_lock(&wfs->alloc_lock);
+   res = vmfs_block_set_status_list_locked(fs,blk_ids,count,status);
+   pthread_mutex_unlock(&wfs->alloc_lock);
+   return(res);
+}
+
+/* Allocate or free the specified block */
+static int vmfs_block_set_status(const vmfs_fs_t *fs,uint32_t blk_id,
+                                 int status)
+{
+   return((vmfs_block_set_status_list(fs,&blk_id,1,status) == 1) ? 0 : -1);
 }
 
 /* Allocate the specified block */
@@ -143,8 +240,15 @@ int vmfs_block_free(const vmfs_fs_t *fs,uint32_t blk_id)
    return(vmfs_block_set_status(fs,blk_id,0));
 }
 
-/* Allocate a single block */
-int vmfs_block_alloc(const vmfs_fs_t *fs,uint32_t blk_type,uint32_t *blk_id)
+/* Free a list of blocks (the list is sorted in place) */
+int vmfs_block_free_list(const vmfs_fs_t *fs,uint32_t *blk_ids,u_int count)
+{
+   return(vmfs_block_set_status_list(fs,blk_ids,count,0));
+}
+
+/* Allocate a single block, with the allocator lock held */
+static int vmfs_block_alloc_locked(const vmfs_fs_t *fs,uint32_t blk_type,
+                                   uint32_t *blk_id)
 {
    vmfs_bitmap_t *bmp;
    vmfs_bitmap_entry_t entry;
@@ -163,6 +267,7 @@ int vmfs_block_alloc(const vmfs_fs_t *fs,uint32_t blk_type,uint32_t *blk_id)
 
    vmfs_bme_update(fs,&entry);
    vmfs_metadata_unlock((vmfs_fs_t *)fs,&entry.mdh);
+   vmfs_fs_update_allocated_items(fs,blk_type,1);
 
    switch(blk_type) {
       case VMFS_BLK_TYPE_FB:
@@ -183,6 +288,18 @@ int vmfs_block_alloc(const vmfs_fs_t *fs,uint32_t blk_type,uint32_t *blk_id)
    return(0);
 }
 
+/* Allocate a single block */
+int vmfs_block_alloc(const vmfs_fs_t *fs,uint32_t blk_type,uint32_t *blk_id)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+   int res;
+
+   pthread_mutex_lock(&wfs->alloc_lock);
+   res = vmfs_block_alloc_locked(fs,blk_type,blk_id);
+   pthread_mutex_unlock(&wfs->alloc_lock);
+   return(res);
+}
+
 /* Zeroize a file block */
 int vmfs_block_zeroize_fb(const vmfs_fs_t *fs,uint32_t blk_id)
 {
@@ -214,6 +331,7 @@ int vmfs_block_free_pb(const vmfs_fs_t *fs,uint32_t pb_blk,
 {     
    DECL_ALIGNED_BUFFER(buf,fs->pbc->bmh.data_size);
    uint32_t pbc_entry,pbc_item;
+   uint32_t *free_list;
    uint32_t blk_id;
    int i,count = 0;
 
@@ -226,16 +344,22 @@ int vmfs_block_free_pb(const vmfs_fs_t *fs,uint32_t pb_blk,
    if (!vmfs_bitmap_get_item(fs->pbc,pbc_entry,pbc_item,buf))
       return(-EIO);
 
+   if (!(free_list = malloc(buf_len)))
+      return(-ENOMEM);
+
    for(i=start;i<end;i++) {
       blk_id = read_le32(buf,i*sizeof(uint32_t));
 
       if (blk_id != 0) {
-         vmfs_block_free(fs,blk_id);
+         free_list[count++] = blk_id;
          write_le32(buf,i*sizeof(uint32_t),0);
-         count++;
       }
    }
 
+   /* Free all the blocks at once, grouped by bitmap entry */
+   vmfs_block_free_list(fs,free_list,count);
+   free(free_list);
+
    if ((start == 0) && (end == (buf_len / sizeof(uint32_t))))
       vmfs_block_free(fs,pb_blk);
    else {
@@ -155,6 +155,9 @@ struct vmfs_block_info {
 /* Get bitmap info (bitmap type,entry and item) from a block ID */
 int vmfs_block_get_info(uint32_t blk_id, vmfs_block_info_t *info);
 
+/* Compare two block IDs by bitmap position, for qsort() */
+int vmfs_block_cmp(const void *a,const void *b);
+
 /* Get block status (allocated or free) */
 int vmfs_block_get_status(const vmfs_fs_t *fs,uint32_t blk_id);
 
@@ -164,6 +167,9 @@ int vmfs_block_alloc_specified(const vmfs_fs_t *fs,uint32_t blk_id);
 /* Free the specified block */
 int vmfs_block_free(const vmfs_fs_t *fs,uint32_t blk_id);
 
+/* Free a list of blocks (the list is sorted in place) */
+int vmfs_block_free_list(const vmfs_fs_t *fs,uint32_t *blk_ids,u_int count);
+
 /* Allocate a single block */
 int vmfs_block_alloc(const vmfs_fs_t *fs,uint32_t blk_type,uint32_t *blk_id);
 
@@ -26,6 +26,8 @@ struct vmfs_device {
                     const u_char *buf, size_t len);
    int (*reserve)(const vmfs_device_t *dev, off_t pos);
    int (*release)(const vmfs_device_t *dev, off_t pos);
+   int (*map)(const vmfs_device_t *dev, off_t pos, size_t len,
+              int *fd, off_t *fd_pos);
    void (*close)(vmfs_device_t *dev);
    uuid_t *uuid;
 };
@@ -58,6 +60,15 @@ static inline int vmfs_device_release(const vmfs_device_t *dev, off_t pos)
    return 0;
 }
 
+/* Get the host file descriptor and offset where a device range is stored */
+static inline int vmfs_device_map(const vmfs_device_t *dev, off_t pos,
+                                  size_t len, int *fd, off_t *fd_pos)
+{
+   if (dev->map)
+     return dev->map(dev, pos, len, fd, fd_pos);
+   return -1;
+}
+
 static inline void vmfs_device_close(vmfs_device_t *dev)
 {
    if (dev->close)
@@ -46,30 +46,473 @@ static int vmfs_dirent_write(const vmfs_dirent_t *entry,u_char *buf)
    return(0);
 }
 
+/* Hash a directory entry name */
+static inline uint32_t vmfs_dir_hash_name(const char *name,size_t len)
+{
+   uint32_t hash = 2166136261U;
+   size_t i;
+
+   for(i=0;i<len;i++)
+      hash = (hash ^ (u_char)name[i]) * 16777619U;
+
+   return(hash);
+}
+
+/* Get the name of a cached directory entry */
+static inline const char *vmfs_dir_cached_name(const vmfs_dir_t *d,
+                                               uint32_t idx)
+{
+   return((const char *)d->cache->buf + (idx * VMFS_DIRENT_SIZE) +
+          VMFS_DIRENT_OFS_NAME);
+}
+
+/* Get the number of entries in a directory */
+static inline uint32_t vmfs_dir_entry_count(const vmfs_dir_t *d)
+{
+   return(vmfs_file_get_size(d->dir) / VMFS_DIRENT_SIZE);
+}
+
+/* Get the hash bucket of a cached directory entry */
+static inline u_int vmfs_dir_index_bucket(const vmfs_dir_t *d,uint32_t idx)
+{
+   const char *name = vmfs_dir_cached_name(d,idx);
+   size_t len = strnlen(name,VMFS_DIRENT_OFS_NAME_SIZE);
+
+   return(vmfs_dir_hash_name(name,len) & (d->cache->hash_buckets - 1));
+}
+
+/* Free the hash index of a directory cache */
+static void vmfs_dir_index_free(vmfs_dir_cache_t *c)
+{
+   free(c->hash);
+   free(c->hash_next);
+   c->hash = c->hash_next = NULL;
+   c->hash_buckets = c->hash_size = 0;
+}
+
+/* Build the hash index over the cached entries of a directory */
+static int vmfs_dir_index_build(vmfs_dir_t *d)
+{
+   vmfs_dir_cache_t *c = d->cache;
+   uint32_t count,idx;
+   u_int bucket;
+
+   vmfs_dir_index_free(c);
+   count = vmfs_dir_entry_count(d);
+
+   /* Keep some room for new entries */
+   c->hash_size = m_max(count * 2,16);
+
+   for(c->hash_buckets=16;c->hash_buckets<count;c->hash_buckets<<=1)
+      ;
+
+   if (!(c->hash = calloc(c->hash_buckets,sizeof(uint32_t))) ||
+       !(c->hash_next = calloc(c->hash_size,sizeof(uint32_t))))
+   {
+      vmfs_dir_index_free(c);
+      return(-1);
+   }
+
+   /* Insert backwards, so that chains are in directory order */
+   for(idx=count;idx>0;idx--) {
+      bucket = vmfs_dir_index_bucket(d,idx-1);
+      c->hash_next[idx-1] = c->hash[bucket];
+      c->hash[bucket] = idx;
+   }
+
+   return(0);
+}
+
+/* Add a cached entry to the hash index */
+static void vmfs_dir_index_add(vmfs_dir_t *d,uint32_t idx)
+{
+   vmfs_dir_cache_t *c = d->cache;
+   u_int bucket;
+
+   if (!c->hash)
+      return;
+
+   if ((idx >= c->hash_size) || (idx >= c->hash_buckets * 2)) {
+      if (vmfs_dir_index_build(d) == -1)
+         vmfs_dir_index_free(c);
+      return;
+   }
+
+   bucket = vmfs_dir_index_bucket(d,idx);
+   c->hash_next[idx] = c->hash[bucket];
+   c->hash[bucket] = idx + 1;
+}
+
+/* Remove a cached entry from the hash index */
+static void vmfs_dir_index_remove(vmfs_dir_t *d,uint32_t idx)
+{
+   vmfs_dir_cache_t *c = d->cache;
+   uint32_t *p;
+
+   if (!c->hash)
+      return;
+
+   for(p=&c->hash[vmfs_dir_index_bucket(d,idx)];*p;p=&c->hash_next[*p-1]) {
+      if (*p == idx + 1) {
+         *p = c->hash_next[idx];
+         c->hash_next[idx] = 0;
+         return;
+      }
+   }
+}
+
 /* Search for an entry into a directory ; affects position of the next
 entry vmfs_dir_read will return */
 const vmfs_dirent_t *vmfs_dir_lookup(vmfs_dir_t *d,const char *name)
 {
-   const vmfs_dirent_t *rec;
+   vmfs_dir_cache_t *c;
+   const vmfs_dirent_t *rec = NULL;
+   size_t len;
+   uint32_t idx;
+
+   if (d == NULL)
+      return(NULL);
+
+   c = d->cache;
+   vmfs_inode_lock(d->dir->inode);
+
+   if (c->buf && (c->hash || !vmfs_dir_index_build(d))) {
+      len = strlen(name);
+
+      if (len <= VMFS_DIRENT_OFS_NAME_SIZE) {
+         idx = c->hash[vmfs_dir_hash_name(name,len) & (c->hash_buckets - 1)];
+
+         for(;idx;idx=c->hash_next[idx-1]) {
+            const char *ename = vmfs_dir_cached_name(d,idx-1);
+
+            if ((strnlen(ename,VMFS_DIRENT_OFS_NAME_SIZE) == len) &&
+                !memcmp(ename,name,len))
+            {
+               vmfs_dir_seek(d,idx-1);
+               rec = vmfs_dir_read(d);
+               goto done;
+            }
+         }
+      }
+
+      vmfs_dir_seek(d,vmfs_dir_entry_count(d));
+      goto done;
+   }
+
    vmfs_dir_seek(d,0);
 
    while((rec = vmfs_dir_read(d))) {
       if (!strcmp(rec->name,name))
-         return(rec);
+         break;
+   }
+
+ done:
+   vmfs_inode_unlock(d->dir->inode);
+   return(rec);
+}
+
+/* Hash function to retrieve a dentry */
+static inline u_int vmfs_dentry_hash(const vmfs_fs_t *fs,uint32_t dir_id,
+                                     const char *name,size_t len)
+{
+   uint32_t hash = vmfs_dir_hash_name(name,len);
+
+   return((hash ^ dir_id ^ (dir_id >> 9)) & (fs->dentry_hash_buckets - 1));
+}
+
+/*
+ * The dentry cache is protected by the dentry_lock of the filesystem,
+ * which must be held when calling the following functions, up to
+ * vmfs_dentry_invalidate().
+ */
+
+/* Remove a dentry from the cache and free it */
+static void vmfs_dentry_free(const vmfs_fs_t *fs,vmfs_dentry_t *de)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+
+   /* Remove from hash table */
+   if (de->next != NULL)
+      de->next->pprev = de->pprev;
+
+   *(de->pprev) = de->next;
+
+   /* Remove from LRU list */
+   if (de->lru_prev != NULL)
+      de->lru_prev->lru_next = de->lru_next;
+   else
+      wfs->dentry_lru_first = de->lru_next;
+
+   if (de->lru_next != NULL)
+      de->lru_next->lru_prev = de->lru_prev;
+   else
+      wfs->dentry_lru_last = de->lru_prev;
+
+   wfs->dentry_count--;
+   free(de->symlink);
+   free(de);
+}
+
+/* Move a dentry to the most recently used end of the LRU list */
+static void vmfs_dentry_touch(const vmfs_fs_t *fs,vmfs_dentry_t *de)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+
+   if (de == fs->dentry_lru_last)
+      return;
+
+   /* Unlink, de has a successor */
+   if (de->lru_prev != NULL)
+      de->lru_prev->lru_next = de->lru_next;
+   else
+      wfs->dentry_lru_first = de->lru_next;
+
+   de->lru_next->lru_prev = de->lru_prev;
+
+   /* Append */
+   de->lru_prev = fs->dentry_lru_last;
+   de->lru_next = NULL;
+   wfs->dentry_lru_last->lru_next = de;
+   wfs->dentry_lru_last = de;
+}
+
+/* Find a dentry in the cache */
+static vmfs_dentry_t *vmfs_dentry_find(const vmfs_fs_t *fs,uint32_t dir_id,
+                                       const char *name)
+{
+   vmfs_dentry_t *de;
+   size_t len = strlen(name);
+   u_int hb;
+
+   hb = vmfs_dentry_hash(fs,dir_id,name,len);
+
+   for(de=fs->dentries[hb];de;de=de->next) {
+      if ((de->dir_id != dir_id) || strcmp(de->name,name))
+         continue;
+
+      /* Expired entries may be out of date if other hosts did changes */
+      if (vmfs_host_get_uptime() >= de->expire) {
+         vmfs_dentry_free(fs,de);
+         return NULL;
+      }
+
+      vmfs_dentry_touch(fs,de);
+      return de;
+   }
+
+   return NULL;
+}
+
+/* Add a dentry to the cache */
+static vmfs_dentry_t *vmfs_dentry_add(const vmfs_fs_t *fs,uint32_t dir_id,
+                                      const char *name,uint32_t blk_id,
+                                      uint32_t type)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+   vmfs_dentry_t *de;
+   size_t len = strlen(name);
+   u_int hb;
+
+   if (len > VMFS_DIRENT_OFS_NAME_SIZE)
+      return NULL;
+
+   /* Evict the least recently used entry if the cache is full */
+   if (fs->dentry_count >= VMFS_DENTRY_CACHE_SIZE)
+      vmfs_dentry_free(fs,fs->dentry_lru_first);
+
+   if (!(de = calloc(1,sizeof(*de))))
+      return NULL;
+
+   de->dir_id = dir_id;
+   de->blk_id = blk_id;
+   de->type   = type;
+   de->expire = vmfs_host_get_uptime() + VMFS_DENTRY_EXPIRE_DELAY;
+   memcpy(de->name,name,len+1);
+
+   /* Insert into hash table */
+   hb = vmfs_dentry_hash(fs,dir_id,name,len);
+   de->next  = fs->dentries[hb];
+   de->pprev = &wfs->dentries[hb];
+
+   if (de->next != NULL)
+      de->next->pprev = &de->next;
+
+   wfs->dentries[hb] = de;
+
+   /* Append to LRU list */
+   de->lru_prev = fs->dentry_lru_last;
+
+   if (de->lru_prev != NULL)
+      de->lru_prev->lru_next = de;
+   else
+      wfs->dentry_lru_first = de;
+
+   wfs->dentry_lru_last = de;
+   wfs->dentry_count++;
+   return de;
+}
+
+/* Drop the cached dentry for a name in a directory */
+static void vmfs_dentry_invalidate(const vmfs_fs_t *fs,uint32_t dir_id,
+                                   const char *name)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+   vmfs_dentry_t *de;
+
+   pthread_mutex_lock(&wfs->dentry_lock);
+
+   if ((de = vmfs_dentry_find(fs,dir_id,name)) != NULL)
+      vmfs_dentry_free(fs,de);
+
+   pthread_mutex_unlock(&wfs->dentry_lock);
+}
+
+/* Drop all the cached dentries for a directory */
+static void vmfs_dentry_invalidate_dir(const vmfs_fs_t *fs,uint32_t dir_id)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+   vmfs_dentry_t *de,*next;
+
+   pthread_mutex_lock(&wfs->dentry_lock);
+
+   for(de=fs->dentry_lru_first;de;de=next) {
+      next = de->lru_next;
+
+      if (de->dir_id == dir_id)
+         vmfs_dentry_free(fs,de);
+   }
+
+   pthread_mutex_unlock(&wfs->dentry_lock);
+}
+
+/* Drop all the entries of the dentry cache */
+void vmfs_dentry_cache_flush(const vmfs_fs_t *fs)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+
+   pthread_mutex_lock(&wfs->dentry_lock);
+
+   while(fs->dentry_lru_first != NULL)
+      vmfs_dentry_free(fs,fs->dentry_lru_first);
+
+   pthread_mutex_unlock(&wfs->dentry_lock);
+}
+
+/* Add a dentry to the cache if it is not already there */
+static void vmfs_dentry_insert(const vmfs_fs_t *fs,uint32_t dir_id,
+                               const char *name,uint32_t blk_id,
+                               uint32_t type)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+
+   pthread_mutex_lock(&wfs->dentry_lock);
+
+   if (!vmfs_dentry_find(fs,dir_id,name))
+      vmfs_dentry_add(fs,dir_id,name,blk_id,type);
+
+   pthread_mutex_unlock(&wfs->dentry_lock);
+}
+
+/*
+ * Look up a name in a directory given by its block id, using the cache.
+ * The block id and type are copied, since the dentry may be evicted by
+ * another thread at any time. A null block id means there is no such entry.
+ */
+static int vmfs_dir_lookup_dentry(const vmfs_fs_t *fs,uint32_t dir_id,
+                                  const char *name,uint32_t *blk_id,
+                                  uint32_t *type)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+   const vmfs_dirent_t *rec;
+   vmfs_dentry_t *de;
+   vmfs_dir_t *d;
+
+   pthread_mutex_lock(&wfs->dentry_lock);
+
+   if ((de = vmfs_dentry_find(fs,dir_id,name)) != NULL) {
+      *blk_id = de->blk_id;
+      *type = de->type;
+   }
+
+   pthread_mutex_unlock(&wfs->dentry_lock);
+
+   if (de != NULL)
+      return(0);
+
+   if (!(d = vmfs_dir_open_from_blkid(fs,dir_id)))
+      return(-1);
+
+   /* 
+    * The directory lock is held until the dentry is inserted, so that a
+    * concurrent link or unlink invalidates it after the insertion.
+    * Negative entries are cached too, with a null block id.
+    */
+   vmfs_inode_lock(d->dir->inode);
+
+   if ((rec = vmfs_dir_lookup(d,name)) != NULL) {
+      *blk_id = rec->block_id;
+      *type = rec->type;
+   } else {
+      *blk_id = *type = 0;
    }
 
-   return(NULL);
+   vmfs_dentry_insert(fs,dir_id,name,*blk_id,*type);
+   vmfs_inode_unlock(d->dir->inode);
+   vmfs_dir_close(d);
+   return(0);
+}
+
+/* Look up a name in a directory given by its block id */
+uint32_t vmfs_dir_lookup_blkid(const vmfs_fs_t *fs,uint32_t dir_id,
+                               const char *name)
+{
+   uint32_t blk_id,type;
+
+   if (vmfs_dir_lookup_dentry(fs,dir_id,name,&blk_id,&type) == -1)
+      return(0);
+
+   return(blk_id);
+}
+
+/* 
+ * Add an entry read from a directory to the dentry cache. The entry is
+ * only added if the directory still holds it, as it may have been unlinked
+ * since it was read.
+ */
+void vmfs_dentry_cache_add(vmfs_dir_t *d,const vmfs_dirent_t *entry)
+{
+   const vmfs_fs_t *fs = vmfs_dir_get_fs(d);
+   const vmfs_dirent_t *rec;
+   vmfs_dirent_t copy;
+   uint32_t pos = d->pos;
+
+   if ((fs == NULL) || (pos == 0))
+      return;
+
+   /* The entry is usually the one returned by vmfs_dir_read() */
+   copy = *entry;
+
+   /* Read back the last returned entry */
+   vmfs_inode_lock(d->dir->inode);
+   vmfs_dir_seek(d,pos-1);
+
+   if ((rec = vmfs_dir_read(d)) && (rec->block_id == copy.block_id) &&
+       !strcmp(rec->name,copy.name))
+      vmfs_dentry_insert(fs,d->dir->inode->id,copy.name,copy.block_id,
+                         copy.type);
+
+   vmfs_dir_seek(d,pos);
+   vmfs_inode_unlock(d->dir->inode);
 }
 
 /* Read a symlink */
-static char *vmfs_dirent_read_symlink(const vmfs_fs_t *fs,
-                                      const vmfs_dirent_t *entry)
+static char *vmfs_dirent_read_symlink(const vmfs_fs_t *fs,uint32_t blk_id)
 {
    vmfs_file_t *f;
    size_t str_len;
    char *str = NULL;
 
-   if (!(f = vmfs_file_open_from_blkid(fs,entry->block_id)))
+   if (!(f = vmfs_file_open_from_blkid(fs,blk_id)))
       return NULL;
 
    str_len = vmfs_file_get_size(f);
@@ -79,6 +522,7 @@ static char *vmfs_dirent_read_symlink(const vmfs_fs_t *fs,
 
    if ((str_len = vmfs_file_pread(f,(u_char *)str,str_len,0)) == -1) {
       free(str);
+      str = NULL;
       goto done;
    }
 
@@ -89,32 +533,55 @@ static char *vmfs_dirent_read_symlink(const vmfs_fs_t *fs,
    return str;
 }
 
-/* Resolve a path name to a block id */
-uint32_t vmfs_dir_resolve_path(vmfs_dir_t *base_dir,const char *path,
-                               int follow_symlink)
+/* Get a copy of a symlink target, which is kept in its dentry */
+static char *vmfs_dentry_get_symlink(const vmfs_fs_t *fs,uint32_t dir_id,
+                                     const char *name,uint32_t blk_id)
 {
-   vmfs_dir_t *cur_dir,*sub_dir;
-   const vmfs_dirent_t *rec;
-   char *nam, *ptr,*sl,*symlink;
-   int close_dir = 0;
-   const vmfs_fs_t *fs = vmfs_dir_get_fs(base_dir);
-   uint32_t ret = 0;
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+   vmfs_dentry_t *de;
+   char *str = NULL;
+
+   pthread_mutex_lock(&wfs->dentry_lock);
+
+   if ((de = vmfs_dentry_find(fs,dir_id,name)) && de->symlink)
+      str = strdup(de->symlink);
+
+   pthread_mutex_unlock(&wfs->dentry_lock);
+
+   if (str || !(str = vmfs_dirent_read_symlink(fs,blk_id)))
+      return str;
+
+   pthread_mutex_lock(&wfs->dentry_lock);
+
+   if ((de = vmfs_dentry_find(fs,dir_id,name)) && (de->blk_id == blk_id) &&
+       !de->symlink)
+      de->symlink = strdup(str);
+
+   pthread_mutex_unlock(&wfs->dentry_lock);
+   return str;
+}
 
-   cur_dir = base_dir;
+/* Resolve a path name to a block id, starting from a directory block id */
+static uint32_t vmfs_dir_resolve_path_at(const vmfs_fs_t *fs,uint32_t dir_id,
+                                         const char *path,int follow_symlink,
+                                         u_int depth)
+{
+   char *nam,*ptr,*sl,*symlink;
+   uint32_t ret,blk_id,type;
+
+   /* Avoid looping forever on symlink loops */
+   if (depth > VMFS_DIR_MAX_SYMLINK_DEPTH)
+      return(0);
 
    if (*path == '/') {
-      if (!(cur_dir = vmfs_dir_open_from_blkid(fs,VMFS_BLK_FD_BUILD(0, 0, 0))))
-         return(0);
+      dir_id = VMFS_BLK_FD_BUILD(0, 0, 0);
       path++;
-      close_dir = 1;
    }
 
-   if (!(rec = vmfs_dir_lookup(cur_dir,".")))
-      return(0);
-
-   ret = rec->block_id;
+   ret = dir_id;
 
-   nam = ptr = strdup(path);
+   if (!(nam = ptr = strdup(path)))
+      return(0);
    
    while(*ptr != 0) {
       sl = strchr(ptr,'/');
@@ -126,25 +593,27 @@ uint32_t vmfs_dir_resolve_path(vmfs_dir_t *base_dir,const char *path,
          ptr = sl + 1;
          continue;
       }
-             
-      if (!(rec = vmfs_dir_lookup(cur_dir,ptr))) {
+
+      if ((vmfs_dir_lookup_dentry(fs,dir_id,ptr,&blk_id,&type) == -1) ||
+          !blk_id)
+      {
          ret = 0;
          break;
       }
       
-      ret = rec->block_id;
+      ret = blk_id;
 
       if ((sl == NULL) && !follow_symlink)
          break;
 
       /* follow the symlink if we have an entry of this type */
-      if (rec->type == VMFS_FILE_TYPE_SYMLINK) {
-         if (!(symlink = vmfs_dirent_read_symlink(fs,rec))) {
+      if (type == VMFS_FILE_TYPE_SYMLINK) {
+         if (!(symlink = vmfs_dentry_get_symlink(fs,dir_id,ptr,blk_id))) {
             ret = 0;
             break;
          }
 
-         ret = vmfs_dir_resolve_path(cur_dir,symlink,1);
+         ret = vmfs_dir_resolve_path_at(fs,dir_id,symlink,1,depth+1);
          free(symlink);
 
          if (!ret)
@@ -155,65 +624,153 @@ uint32_t vmfs_dir_resolve_path(vmfs_dir_t *base_dir,const char *path,
       if (sl == NULL)
          break;
 
-      /* we must have a directory here */
-      if (!(sub_dir = vmfs_dir_open_from_blkid(fs,ret)))
-      {
-         ret = 0;
-         break;
-      }
-
-      if (close_dir)
-         vmfs_dir_close(cur_dir);
-
-      cur_dir = sub_dir;
-      close_dir = 1;
+      /* the next lookup will fail if this is not a directory */
+      dir_id = ret;
       ptr = sl + 1;
    }
    free(nam);
 
-   if (close_dir)
-      vmfs_dir_close(cur_dir);
-
    return(ret);
 }
 
+/* Resolve a path name to a block id */
+uint32_t vmfs_dir_resolve_path(vmfs_dir_t *base_dir,const char *path,
+                               int follow_symlink)
+{
+   const vmfs_fs_t *fs = vmfs_dir_get_fs(base_dir);
+
+   if (!fs)
+      return(0);
+
+   return(vmfs_dir_resolve_path_at(fs,base_dir->dir->inode->id,path,
+                                   follow_symlink,0));
+}
+
+/* Drop cached content of a directory */
+static void vmfs_dir_uncache_entries(vmfs_dir_cache_t *c)
+{
+   free(c->buf);
+   c->buf = NULL;
+   c->buf_size = 0;
+   vmfs_dir_index_free(c);
+}
+
 /* Cache content of a directory */
 static int vmfs_dir_cache_entries(vmfs_dir_t *d)
 {
+   vmfs_dir_cache_t *c = d->cache;
    off_t dir_size;
 
-   if (d->buf != NULL)
-      free(d->buf);
+   vmfs_dir_uncache_entries(c);
 
    dir_size = vmfs_file_get_size(d->dir);
+   c->expire = vmfs_host_get_uptime() + VMFS_DENTRY_EXPIRE_DELAY;
 
-   if (!(d->buf = calloc(1,dir_size)))
+   if (!(c->buf = calloc(1,dir_size)))
       return(-1);
 
-   if (vmfs_file_pread(d->dir,d->buf,dir_size,0) != dir_size) {
-      free(d->buf);
+   c->buf_size = dir_size;
+
+   if (vmfs_file_pread(d->dir,c->buf,dir_size,0) != dir_size) {
+      vmfs_dir_uncache_entries(c);
       return(-1);
    }
 
    return(0);
 }
 
+/* Append an entry to the cached content of a directory */
+static void vmfs_dir_cache_append(vmfs_dir_t *d,const u_char *buf,off_t pos)
+{
+   vmfs_dir_cache_t *c = d->cache;
+   size_t size;
+   u_char *nbuf;
+
+   if (!c->buf)
+      return;
+
+   /* Grow the buffer geometrically to keep appends cheap */
+   if (pos + VMFS_DIRENT_SIZE > c->buf_size) {
+      size = m_max(c->buf_size * 2,pos + VMFS_DIRENT_SIZE);
+
+      if (!(nbuf = realloc(c->buf,size))) {
+         vmfs_dir_uncache_entries(c);
+         return;
+      }
+
+      c->buf = nbuf;
+      c->buf_size = size;
+   }
+
+   memcpy(c->buf + pos,buf,VMFS_DIRENT_SIZE);
+   vmfs_dir_index_add(d,pos / VMFS_DIRENT_SIZE);
+}
+
+/* Get the content cache shared by all the handles on a directory, with the
+directory inode lock held */
+static int vmfs_dir_cache_acquire(vmfs_dir_t *d)
+{
+   vmfs_inode_t *inode = d->dir->inode;
+   vmfs_dir_cache_t *c = inode->dir_cache;
+
+   if (c == NULL) {
+      if (!(c = calloc(1,sizeof(*c))))
+         return(-1);
+
+      /* The inode holds a reference until it leaves the inode cache */
+      c->ref_count = 1;
+      inode->dir_cache = c;
+   }
+
+   c->ref_count++;
+   d->cache = c;
+
+   /* Refresh the content when no other handle is using it */
+   if ((c->ref_count == 2) &&
+       (!c->buf || (vmfs_host_get_uptime() >= c->expire)))
+      vmfs_dir_cache_entries(d);
+
+   return(0);
+}
+
+/* Release a directory content cache */
+void vmfs_dir_cache_release(vmfs_dir_cache_t *c)
+{
+   if ((c == NULL) || --c->ref_count)
+      return;
+
+   vmfs_dir_uncache_entries(c);
+   free(c);
+}
+
 /* Open a directory file */
 static vmfs_dir_t *vmfs_dir_open_from_file(vmfs_file_t *file)
 {
    vmfs_dir_t *d;
+   int res;
 
    if (file == NULL)
       return NULL;
 
    if (!(d = calloc(1, sizeof(*d))) ||
        (file->inode->type != VMFS_FILE_TYPE_DIR)) {
+      free(d);
       vmfs_file_close(file);
       return NULL;
    }
 
    d->dir = file;
-   vmfs_dir_cache_entries(d);
+
+   vmfs_inode_lock(file->inode);
+   res = vmfs_dir_cache_acquire(d);
+   vmfs_inode_unlock(file->inode);
+
+   if (res == -1) {
+      vmfs_file_close(file);
+      free(d);
+      return NULL;
+   }
+
    return d;
 }
 
@@ -239,26 +796,34 @@ vmfs_dir_t *vmfs_dir_open_at(vmfs_dir_t *d,const char *path)
 by subsequent calls */
 const vmfs_dirent_t *vmfs_dir_read(vmfs_dir_t *d)
 {
+   const vmfs_dirent_t *res = NULL;
+   u_char _buf[VMFS_DIRENT_SIZE];
    u_char *buf;
+
    if (d == NULL)
       return(NULL);
 
-   if (d->buf) {
+   /* Other handles may change the shared content */
+   vmfs_inode_lock(d->dir->inode);
+
+   if (d->cache->buf) {
       if (d->pos*VMFS_DIRENT_SIZE >= vmfs_file_get_size(d->dir))
-         return(NULL);
-      buf = &d->buf[d->pos*VMFS_DIRENT_SIZE];
+         goto done;
+      buf = &d->cache->buf[d->pos*VMFS_DIRENT_SIZE];
    } else {
-      u_char _buf[VMFS_DIRENT_SIZE];
       if ((vmfs_file_pread(d->dir,_buf,sizeof(_buf),
                            d->pos*sizeof(_buf)) != sizeof(_buf)))
-         return(NULL);
+         goto done;
       buf = _buf;
    }
 
    vmfs_dirent_read(&d->dirent,buf);
    d->pos++;
+   res = &d->dirent;
 
-   return &d->dirent;
+ done:
+   vmfs_inode_unlock(d->dir->inode);
+   return(res);
 }
 
 /* Close a directory */
@@ -267,16 +832,19 @@ int vmfs_dir_close(vmfs_dir_t *d)
    if (d == NULL)
       return(-1);
 
-   if (d->buf)
-      free(d->buf);
+   vmfs_inode_lock(d->dir->inode);
+   vmfs_dir_cache_release(d->cache);
+   vmfs_inode_unlock(d->dir->inode);
 
    vmfs_file_close(d->dir);
    free(d);
    return(0);
 }
 
-/* Link an inode to a directory with the specified name */
-int vmfs_dir_link_inode(vmfs_dir_t *d,const char *name,vmfs_inode_t *inode)
+/* Link an inode to a directory with the specified name, with the directory
+inode lock held */
+static int vmfs_dir_link_inode_locked(vmfs_dir_t *d,const char *name,
+                                      vmfs_inode_t *inode)
 {  
    vmfs_fs_t *fs = (vmfs_fs_t *)vmfs_dir_get_fs(d);
    u_char buf[VMFS_DIRENT_SIZE];
@@ -304,14 +872,35 @@ int vmfs_dir_link_inode(vmfs_dir_t *d,const char *name,vmfs_inode_t *inode)
    if (res != sizeof(buf))
       return((res < 0) ? res : -ENOSPC);
 
-   inode->nlink++;
+   vmfs_dir_cache_append(d,buf,dir_size);
 
-   vmfs_dir_cache_entries(d);
+   /* Drop any negative entry for that name */
+   vmfs_dentry_invalidate(fs,d->dir->inode->id,name);
    return(0);
 }
 
-/* Unlink an inode from a directory */
-int vmfs_dir_unlink_inode(vmfs_dir_t *d,off_t pos,vmfs_dirent_t *entry)
+/* Link an inode to a directory with the specified name */
+int vmfs_dir_link_inode(vmfs_dir_t *d,const char *name,vmfs_inode_t *inode)
+{
+   int res;
+
+   vmfs_inode_lock(d->dir->inode);
+   res = vmfs_dir_link_inode_locked(d,name,inode);
+   vmfs_inode_unlock(d->dir->inode);
+
+   /* Not nested in the directory lock, since ".." links to the parent */
+   if (res == 0) {
+      vmfs_inode_lock(inode);
+      inode->nlink++;
+      vmfs_inode_unlock(inode);
+   }
+
+   return(res);
+}
+
+/* Unlink an inode from a directory, with the directory inode lock held */
+static int vmfs_dir_unlink_inode_locked(vmfs_dir_t *d,off_t pos,
+                                        vmfs_dirent_t *entry)
 {   
    vmfs_fs_t *fs = (vmfs_fs_t *)vmfs_dir_get_fs(d);
    vmfs_inode_t *inode;
@@ -324,31 +913,66 @@ int vmfs_dir_unlink_inode(vmfs_dir_t *d,off_t pos,vmfs_dirent_t *entry)
    if (!(inode = vmfs_inode_acquire(fs,entry->block_id)))
       return(-ENOENT);
 
+   vmfs_inode_lock(inode);
+
    if (!--inode->nlink) {
-      vmfs_inode_truncate(inode,0);
-      vmfs_block_free(fs,inode->id);
+      vmfs_inode_delete(inode);
    } else {
       inode->update_flags |= VMFS_INODE_SYNC_META;
    }
 
+   vmfs_inode_unlock(inode);
    vmfs_inode_release(inode);
 
    /* Remove the entry itself */
    last_entry = vmfs_file_get_size(d->dir) - VMFS_DIRENT_SIZE;
 
+   if (d->cache->buf) {
+      vmfs_dir_index_remove(d,pos / VMFS_DIRENT_SIZE);
+
+      if (pos != last_entry)
+         vmfs_dir_index_remove(d,last_entry / VMFS_DIRENT_SIZE);
+   }
+
+   /* Move the last entry in place of the removed one, in cache too */
    if (pos != last_entry) {
       u_char buf[VMFS_DIRENT_SIZE];
 
-      vmfs_file_pread(d->dir,buf,sizeof(buf),last_entry);
+      if (d->cache->buf)
+         memcpy(buf,d->cache->buf + last_entry,sizeof(buf));
+      else
+         vmfs_file_pread(d->dir,buf,sizeof(buf),last_entry);
+
       vmfs_file_pwrite(d->dir,buf,sizeof(buf),pos);
+
+      if (d->cache->buf)
+         memcpy(d->cache->buf + pos,buf,sizeof(buf));
    }
 
    vmfs_file_truncate(d->dir,last_entry);
 
-   vmfs_dir_cache_entries(d);
+   if (pos != last_entry)
+      vmfs_dir_index_add(d,pos / VMFS_DIRENT_SIZE);
+
+   vmfs_dentry_invalidate(fs,d->dir->inode->id,entry->name);
+
+   if (entry->type == VMFS_FILE_TYPE_DIR)
+      vmfs_dentry_invalidate_dir(fs,entry->block_id);
+
    return(0);
 }
 
+/* Unlink an inode from a directory */
+int vmfs_dir_unlink_inode(vmfs_dir_t *d,off_t pos,vmfs_dirent_t *entry)
+{
+   int res;
+
+   vmfs_inode_lock(d->dir->inode);
+   res = vmfs_dir_unlink_inode_locked(d,pos,entry);
+   vmfs_inode_unlock(d->dir->inode);
+   return(res);
+}
+
 /* Create a new directory */
 int vmfs_dir_create(vmfs_dir_t *d,const char *name,mode_t mode,
                     vmfs_inode_t **inode)
@@ -368,6 +992,9 @@ int vmfs_dir_create(vmfs_dir_t *d,const char *name,mode_t mode,
    if ((res = vmfs_inode_alloc(fs,VMFS_FILE_TYPE_DIR,mode,&new_inode)) < 0)
       return(res);
 
+   /* The directory handle takes its own reference on the inode */
+   vmfs_inode_ref(new_inode);
+
    if (!(new_dir = vmfs_dir_open_from_inode(new_inode))) {
       res = -ENOENT;
       goto err_open_dir;
@@ -376,6 +1003,7 @@ int vmfs_dir_create(vmfs_dir_t *d,const char *name,mode_t mode,
    vmfs_dir_link_inode(new_dir,".",new_inode);
    vmfs_dir_link_inode(new_dir,"..",d->dir->inode);
    vmfs_dir_link_inode(d,name,new_inode);
+   vmfs_dir_close(new_dir);
 
    *inode = new_inode;
    return(0);
@@ -385,17 +1013,14 @@ int vmfs_dir_create(vmfs_dir_t *d,const char *name,mode_t mode,
    return(res);
 }
 
-/* Delete a directory */
-int vmfs_dir_delete(vmfs_dir_t *d,const char *name)
+/* Delete a directory, with the parent directory inode lock held */
+static int vmfs_dir_delete_locked(vmfs_dir_t *d,const char *name)
 {   
    vmfs_fs_t *fs = (vmfs_fs_t *)vmfs_dir_get_fs(d);
    vmfs_dirent_t *entry;
    vmfs_dir_t *sub;
    off_t pos;
 
-   if (!vmfs_fs_readwrite(fs))
-      return(-EROFS);
-
    if (!(entry = (vmfs_dirent_t *)vmfs_dir_lookup(d,name)))
       return(-ENOENT);
 
@@ -412,8 +1037,11 @@ int vmfs_dir_delete(vmfs_dir_t *d,const char *name)
    }
 
    d->dir->inode->nlink--;
+
+   vmfs_inode_lock(sub->dir->inode);
    sub->dir->inode->nlink = 1;
    sub->dir->inode->update_flags |= VMFS_INODE_SYNC_META;
+   vmfs_inode_unlock(sub->dir->inode);
 
    /* Update the parent directory */
    pos = (d->pos - 1) * VMFS_DIRENT_SIZE;
@@ -423,6 +1051,20 @@ int vmfs_dir_delete(vmfs_dir_t *d,const char *name)
    return(0);
 }
 
+/* Delete a directory */
+int vmfs_dir_delete(vmfs_dir_t *d,const char *name)
+{
+   int res;
+
+   if (!vmfs_fs_readwrite(vmfs_dir_get_fs(d)))
+      return(-EROFS);
+
+   vmfs_inode_lock(d->dir->inode);
+   res = vmfs_dir_delete_locked(d,name);
+   vmfs_inode_unlock(d->dir->inode);
+   return(res);
+}
+
 /* Create a new directory given a path */
 int vmfs_dir_mkdir_at(vmfs_dir_t *d,const char *path,mode_t mode)
 {
@@ -23,6 +23,9 @@
 
 #define VMFS_DIRENT_SIZE    0x8c
 
+/* Maximum number of symlinks followed when resolving a path */
+#define VMFS_DIR_MAX_SYMLINK_DEPTH  40
+
 struct vmfs_dirent_raw {
    uint32_t type;
    uint32_t block_id;
@@ -44,11 +47,36 @@ struct vmfs_dirent {
    char name[129];
 };
 
+/* Directory content, shared by all the handles on a directory */
+struct vmfs_dir_cache {
+   u_char *buf;
+   size_t buf_size;
+
+   /* Hash index over cached entries (entry index + 1, 0 ends chains) */
+   uint32_t *hash,*hash_next;
+   u_int hash_buckets,hash_size;
+
+   u_int ref_count;
+   uint64_t expire;
+};
+
 struct vmfs_dir {
    vmfs_file_t *dir;
    uint32_t pos;
    vmfs_dirent_t dirent;
-   u_char *buf;
+   vmfs_dir_cache_t *cache;
+};
+
+/* Dentry cache entry, for (parent directory, name) pairs */
+struct vmfs_dentry {
+   uint32_t dir_id;
+   uint32_t blk_id;   /* 0 for negative entries */
+   uint32_t type;
+   char *symlink;     /* Symlink target, once read */
+   uint64_t expire;
+   vmfs_dentry_t **pprev,*next;
+   vmfs_dentry_t *lru_prev,*lru_next;
+   char name[VMFS_DIRENT_OFS_NAME_SIZE+1];
 };
 
 static inline const vmfs_fs_t *vmfs_dir_get_fs(vmfs_dir_t *d)
@@ -60,6 +88,11 @@ static inline const vmfs_fs_t *vmfs_dir_get_fs(vmfs_dir_t *d)
 entry vmfs_dir_read will return */
 const vmfs_dirent_t *vmfs_dir_lookup(vmfs_dir_t *dir,const char *name);
 
+/* Look up a name in a directory given by its block id, using the dentry
+cache */
+uint32_t vmfs_dir_lookup_blkid(const vmfs_fs_t *fs,uint32_t dir_id,
+                               const char *name);
+
 /* Resolve a path to a block id */
 uint32_t vmfs_dir_resolve_path(vmfs_dir_t *base_dir,const char *path,
                                int follow_symlink);
@@ -103,4 +136,13 @@ int vmfs_dir_delete(vmfs_dir_t *d,const char *name);
 /* Create a new directory given a path */
 int vmfs_dir_mkdir_at(vmfs_dir_t *d,const char *path,mode_t mode);
 
+/* Release a directory content cache */
+void vmfs_dir_cache_release(vmfs_dir_cache_t *c);
+
+/* Add an entry read from a directory to the dentry cache */
+void vmfs_dentry_cache_add(vmfs_dir_t *d,const vmfs_dirent_t *entry);
+
+/* Drop all the entries of the dentry cache */
+void vmfs_dentry_cache_flush(const vmfs_fs_t *fs);
+
 #endif
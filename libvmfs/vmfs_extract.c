@@ -0,0 +1,305 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* 
+ * Extraction of several files with a pool of threads. Files are split in
+ * pieces following their extent map, and threads copy the pieces of all
+ * the files in turn, so that the underlying storage is kept busy even
+ * with files of very different sizes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "vmfs.h"
+
+/* Extraction state shared by all threads */
+struct vmfs_extract {
+   vmfs_extract_job_t *jobs;
+   u_int count,next;
+   size_t chunk_size;
+   vmfs_extract_progress_cbk_t cbk;
+   void *opt_arg;
+   pthread_mutex_t lock;
+
+   /* Jobs being set up without the lock, and their completion */
+   u_int busy;
+   pthread_cond_t cond;
+};
+
+/* Open the destination of a job */
+static int vmfs_extract_open(vmfs_extract_job_t *job)
+{
+   int fd;
+
+   if ((fd = open(job->dst,O_WRONLY|O_CREAT|O_TRUNC,0644)) == -1)
+      return(-errno);
+
+   /* Holes are left by not writing over them */
+   if (ftruncate(fd,job->size) == -1) {
+      close(fd);
+      return(-errno);
+   }
+
+   return(fd);
+}
+
+/* Close a job once all its pieces are copied, with the lock held */
+static void vmfs_extract_finish(struct vmfs_extract *e,vmfs_extract_job_t *job)
+{
+   if (job->finished || job->pending || job->busy)
+      return;
+
+   if (!job->error && (job->pos < job->size))
+      return;
+
+   if ((job->fd != -1) && (close(job->fd) == -1) && !job->error)
+      job->error = -errno;
+
+   job->fd = -1;
+   vmfs_file_close(job->f);
+   job->f = NULL;
+
+   job->finished = 1;
+
+   if (e->cbk)
+      e->cbk(job,e->opt_arg);
+}
+
+/* 
+ * Set up a job without the lock: open its destination, or look up the
+ * extent at its current position, which may need pointer block reads.
+ * The job is marked busy meanwhile, so that other threads leave it alone.
+ */
+static void vmfs_extract_setup(struct vmfs_extract *e,vmfs_extract_job_t *job)
+{
+   vmfs_extent_t ext;
+   int res,open_dst;
+
+   open_dst = (job->fd == -1);
+   job->busy = 1;
+   e->busy++;
+   pthread_mutex_unlock(&e->lock);
+
+   if (open_dst)
+      res = vmfs_extract_open(job);
+   else
+      res = vmfs_file_get_extent(job->f,job->pos,0,&ext);
+
+   pthread_mutex_lock(&e->lock);
+   job->busy = 0;
+   e->busy--;
+   pthread_cond_broadcast(&e->cond);
+
+   if (res < 0) {
+      job->error = res;
+   } else if (open_dst) {
+      job->fd = res;
+   } else {
+      job->ext_end = ext.pos + ext.len;
+      job->ext_data = (ext.type == VMFS_EXTENT_DATA);
+   }
+}
+
+/* Get the next piece of data to copy, with the lock held */
+static vmfs_extract_job_t *vmfs_extract_next(struct vmfs_extract *e,
+                                             off_t *pos,size_t *len)
+{
+   vmfs_extract_job_t *job;
+   u_int i;
+
+ again:
+   while((e->next < e->count) && e->jobs[e->next].finished)
+      e->next++;
+
+   for(i=e->next;i<e->count;i++) {
+      job = &e->jobs[i];
+
+      if (job->finished || job->busy)
+         continue;
+
+      if (!job->error && ((job->fd == -1) ||
+                          ((job->pos < job->size) &&
+                           (job->pos >= job->ext_end)))) {
+         vmfs_extract_setup(e,job);
+         goto again;
+      }
+
+      /* Skip holes, they are already in the destination */
+      if (!job->error && (job->pos < job->size) && !job->ext_data) {
+         job->done += job->ext_end - job->pos;
+         job->pos = job->ext_end;
+         goto again;
+      }
+
+      if (job->error || (job->pos >= job->size)) {
+         vmfs_extract_finish(e,job);
+         continue;
+      }
+
+      *pos = job->pos;
+      *len = m_min(e->chunk_size,job->ext_end - job->pos);
+      job->pos += *len;
+      job->pending++;
+      return(job);
+   }
+
+   /* Jobs being set up by other threads may still have pieces to copy */
+   if (e->busy) {
+      pthread_cond_wait(&e->cond,&e->lock);
+      goto again;
+   }
+
+   return(NULL);
+}
+
+/* Copy pieces of files until there are none left */
+static void *vmfs_extract_worker(void *arg)
+{
+   struct vmfs_extract *e = arg;
+   vmfs_extract_job_t *job;
+   u_char *buf;
+   size_t len;
+   off_t pos;
+   int res;
+
+   if (!(buf = iobuffer_alloc(e->chunk_size)))
+      return NULL;
+
+   pthread_mutex_lock(&e->lock);
+
+   while((job = vmfs_extract_next(e,&pos,&len))) {
+      pthread_mutex_unlock(&e->lock);
+
+      errno = 0;
+
+      if (vmfs_file_pread(job->f,buf,len,pos) != len)
+         res = -EIO;
+      else if (m_pwrite(job->fd,buf,len,pos) != len)
+         res = errno ? -errno : -EIO;
+      else
+         res = 0;
+
+      pthread_mutex_lock(&e->lock);
+      job->pending--;
+
+      if (res < 0) {
+         if (!job->error)
+            job->error = res;
+      } else {
+         job->done += len;
+         if (e->cbk)
+            e->cbk(job,e->opt_arg);
+      }
+
+      vmfs_extract_finish(e,job);
+   }
+
+   pthread_mutex_unlock(&e->lock);
+   iobuffer_free(buf);
+   return NULL;
+}
+
+/* 
+ * Extract files from a VMFS to the host. The files of the jobs are opened
+ * by the caller, and closed once extracted. The given number of threads
+ * copy pieces of the files, using at most mem_budget bytes of buffers. The
+ * callback is called, serialized, each time a piece of a file is copied
+ * and when a file is finished. Returns the number of failed jobs.
+ */
+int vmfs_extract(const vmfs_fs_t *fs,vmfs_extract_job_t *jobs,u_int count,
+                 u_int threads,size_t mem_budget,
+                 vmfs_extract_progress_cbk_t cbk,void *opt_arg)
+{
+   struct vmfs_extract e;
+   pthread_t *tids;
+   size_t blk_size;
+   int errors = 0;
+   u_int i,started;
+
+   blk_size = vmfs_fs_get_blocksize(fs);
+
+   if (!mem_budget)
+      mem_budget = VMFS_EXTRACT_MEM_BUDGET;
+
+   /* Each thread needs at least a block worth of buffer */
+   threads = m_min(m_max(threads,1),m_max(mem_budget / blk_size,1));
+
+   memset(&e,0,sizeof(e));
+   e.jobs = jobs;
+   e.count = count;
+   e.cbk = cbk;
+   e.opt_arg = opt_arg;
+   e.chunk_size = m_min(mem_budget / threads,VMFS_EXTRACT_MAX_CHUNK);
+   e.chunk_size = m_max(e.chunk_size - (e.chunk_size % blk_size),blk_size);
+
+   for(i=0;i<count;i++) {
+      jobs[i].size = jobs[i].f ? vmfs_file_get_size(jobs[i].f) : 0;
+      jobs[i].done = 0;
+      jobs[i].error = jobs[i].f ? 0 : -ENOENT;
+      jobs[i].finished = 0;
+      jobs[i].fd = -1;
+      jobs[i].pos = jobs[i].ext_end = 0;
+      jobs[i].ext_data = 0;
+      jobs[i].pending = jobs[i].busy = 0;
+   }
+
+   if (!(tids = calloc(threads,sizeof(*tids)))) {
+      for(i=0;i<count;i++) {
+         vmfs_file_close(jobs[i].f);
+         jobs[i].f = NULL;
+      }
+      return(-ENOMEM);
+   }
+
+   pthread_mutex_init(&e.lock,NULL);
+   pthread_cond_init(&e.cond,NULL);
+
+   for(started=0;started<threads;started++)
+      if (pthread_create(&tids[started],NULL,vmfs_extract_worker,&e))
+         break;
+
+   /* Do the work alone if no thread could be started */
+   if (!started)
+      vmfs_extract_worker(&e);
+
+   for(i=0;i<started;i++)
+      pthread_join(tids[i],NULL);
+
+   pthread_cond_destroy(&e.cond);
+   pthread_mutex_destroy(&e.lock);
+   free(tids);
+
+   for(i=0;i<count;i++) {
+      /* Workers gave up, e.g. when out of memory */
+      if (!jobs[i].finished) {
+         if (jobs[i].fd != -1)
+            close(jobs[i].fd);
+         vmfs_file_close(jobs[i].f);
+         jobs[i].f = NULL;
+         if (!jobs[i].error)
+            jobs[i].error = -ENOMEM;
+      }
+
+      if (jobs[i].error)
+         errors++;
+   }
+
+   return(errors);
+}
@@ -0,0 +1,54 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef VMFS_EXTRACT_H
+#define VMFS_EXTRACT_H
+
+/* Default memory budget for file extraction */
+#define VMFS_EXTRACT_MEM_BUDGET  (64 * 1048576)
+
+/* Maximum size of the pieces files are copied by */
+#define VMFS_EXTRACT_MAX_CHUNK   (16 * 1048576)
+
+/* File extraction job */
+struct vmfs_extract_job {
+   const char *src;     /* Name of the file in the VMFS, for reporting */
+   const char *dst;     /* Path of the destination on the host */
+   vmfs_file_t *f;      /* File to extract, opened by the caller */
+   uint64_t size;       /* File size */
+   uint64_t done;       /* Amount of data copied so far, holes included */
+   int error;           /* Negative error code when the extraction failed */
+   int finished;
+
+   /* Extraction state */
+   int fd;
+   off_t pos,ext_end;
+   int ext_data;
+   u_int pending;
+   int busy;
+};
+
+/* Callback function reporting the progress of an extraction job */
+typedef void (*vmfs_extract_progress_cbk_t)(const vmfs_extract_job_t *job,
+                                            void *opt_arg);
+
+/* Extract files from a VMFS */
+int vmfs_extract(const vmfs_fs_t *fs,vmfs_extract_job_t *jobs,u_int count,
+                 u_int threads,size_t mem_budget,
+                 vmfs_extract_progress_cbk_t cbk,void *opt_arg);
+
+#endif
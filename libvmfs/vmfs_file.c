@@ -146,8 +146,58 @@ int vmfs_file_close(vmfs_file_t *f)
    return(0);
 }
 
-/* Read data from a file at the specified position */
-ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
+/* 
+ * Read data from a file block, along with the following blocks when they
+ * are contiguous on disk, so that large reads only need one device read.
+ * Runs stop at LVM segment boundaries, since the next segment may belong
+ * to another extent.
+ */
+static ssize_t vmfs_file_read_fb_run(vmfs_file_t *f,uint32_t blk_id,
+                                     off_t pos,u_char *buf,size_t len)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   uint64_t blk_size,offset,segment;
+   uint32_t next_id;
+   size_t run;
+   u_int count;
+
+   blk_size = vmfs_fs_get_blocksize(fs);
+   offset = pos % blk_size;
+   run = blk_size - offset;
+
+   /* Direct I/O needs aligned reads, vmfs_block_read_fb() handles others */
+   if ((run >= len) || (offset & (M_DIO_BLK_SIZE - 1)) ||
+       !ALIGN_CHECK((uintptr_t)buf,M_DIO_BLK_SIZE))
+      return(vmfs_block_read_fb(fs,blk_id,pos,buf,len));
+
+   segment = (VMFS_BLK_FB_ITEM(blk_id) * blk_size) / VMFS_LVM_SEGMENT_SIZE;
+
+   for(count=1;run+blk_size<=len;count++) {
+      if (vmfs_inode_get_block(f->inode,pos+run,&next_id) < 0)
+         break;
+
+      if ((VMFS_BLK_TYPE(next_id) != VMFS_BLK_TYPE_FB) ||
+          VMFS_BLK_FB_TBZ(next_id) ||
+          (VMFS_BLK_FB_ITEM(next_id) != VMFS_BLK_FB_ITEM(blk_id) + count) ||
+          ((VMFS_BLK_FB_ITEM(next_id) * blk_size) / VMFS_LVM_SEGMENT_SIZE !=
+           segment))
+         break;
+
+      run += blk_size;
+   }
+
+   if (count == 1)
+      return(vmfs_block_read_fb(fs,blk_id,pos,buf,len));
+
+   if (vmfs_fs_read(fs,VMFS_BLK_FB_ITEM(blk_id),offset,buf,run) != run)
+      return(-EIO);
+
+   return(run);
+}
+
+/* Read data from a VMFS file at the specified position */
+static ssize_t vmfs_file_pread_inode(vmfs_file_t *f,u_char *buf,size_t len,
+                                     off_t pos)
 {
    const vmfs_fs_t *fs = vmfs_file_get_fs(f);
    uint32_t blk_id,blk_type;
@@ -157,9 +207,6 @@ ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
    size_t exp_len;
    int err;
 
-   if (f->flags & VMFS_FILE_FLAG_FD)
-      return pread(f->fd, buf, len, pos);
-
    /* We don't handle RDM files */
    if (f->inode->type == VMFS_FILE_TYPE_RDM)
       return(-EIO);
@@ -195,7 +242,7 @@ ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
          /* File-Block */
          case VMFS_BLK_TYPE_FB:
             exp_len = m_min(len,file_size - pos);
-            res = vmfs_block_read_fb(fs,blk_id,pos,buf,exp_len);
+            res = vmfs_file_read_fb_run(f,blk_id,pos,buf,exp_len);
             break;
 
          /* Sub-Block */
@@ -235,20 +282,108 @@ ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
    return(rlen);
 }
 
-/* Write data to a file at the specified position */
-ssize_t vmfs_file_pwrite(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
+/* Read data from a file at the specified position */
+ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
+{
+   ssize_t res;
+
+   if (f->flags & VMFS_FILE_FLAG_FD)
+      return pread(f->fd, buf, len, pos);
+
+   /* Inodes only change on read-write filesystems: don't serialize reads
+      otherwise */
+   if (!vmfs_fs_readwrite(vmfs_file_get_fs(f)))
+      return(vmfs_file_pread_inode(f,buf,len,pos));
+
+   vmfs_inode_lock(f->inode);
+   res = vmfs_file_pread_inode(f,buf,len,pos);
+   vmfs_inode_unlock(f->inode);
+   return(res);
+}
+
+/* Map a file range to the host, see vmfs_file_map() */
+static ssize_t vmfs_file_map_inode(vmfs_file_t *f,off_t pos,size_t len,
+                                   int *fd,off_t *fd_pos)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   uint64_t blk_size,offset,file_size;
+   size_t clen,run = 0;
+   uint32_t blk_id;
+   off_t cur_pos;
+   int cur_fd,err;
+
+   blk_size = vmfs_fs_get_blocksize(fs);
+   file_size = vmfs_file_get_size(f);
+
+   if (pos >= file_size)
+      return(0);
+
+   len = m_min(len,file_size - pos);
+
+   while(run < len) {
+      if ((err = vmfs_inode_get_block(f->inode,pos+run,&blk_id)) < 0)
+         return(run ? run : err);
+
+      /* Only plain file blocks are stored as is */
+      if ((VMFS_BLK_TYPE(blk_id) != VMFS_BLK_TYPE_FB) ||
+          VMFS_BLK_FB_TBZ(blk_id))
+         break;
+
+      offset = (pos + run) % blk_size;
+      clen = m_min(blk_size - offset,len - run);
+
+      if (vmfs_device_map(fs->dev,
+                          (uint64_t)VMFS_BLK_FB_ITEM(blk_id) * blk_size +
+                          offset,clen,&cur_fd,&cur_pos) == -1)
+         break;
+
+      /* Stop at the first block that doesn't follow the previous one */
+      if (run == 0) {
+         *fd = cur_fd;
+         *fd_pos = cur_pos;
+      } else if ((cur_fd != *fd) || (cur_pos != *fd_pos + run)) {
+         break;
+      }
+
+      run += clen;
+   }
+
+   return(run);
+}
+
+/* 
+ * Get the host file descriptor and offset where the file data at the
+ * given position is stored. Returns the length of the contiguous range
+ * that can be read from there (up to len), 0 if the data is not stored
+ * as is on the host (holes, sub-blocks, ...), or a negative error code.
+ */
+ssize_t vmfs_file_map(vmfs_file_t *f,off_t pos,size_t len,
+                      int *fd,off_t *fd_pos)
+{
+   ssize_t res;
+
+   if (f->flags & VMFS_FILE_FLAG_FD)
+      return(0);
+
+   if (!vmfs_fs_readwrite(vmfs_file_get_fs(f)))
+      return(vmfs_file_map_inode(f,pos,len,fd,fd_pos));
+
+   vmfs_inode_lock(f->inode);
+   res = vmfs_file_map_inode(f,pos,len,fd,fd_pos);
+   vmfs_inode_unlock(f->inode);
+   return(res);
+}
+
+/* Write data to a VMFS file at the specified position, with the inode lock
+held */
+static ssize_t vmfs_file_pwrite_inode(vmfs_file_t *f,u_char *buf,size_t len,
+                                      off_t pos)
 {   
    const vmfs_fs_t *fs = vmfs_file_get_fs(f);
    uint32_t blk_id,blk_type;
    ssize_t res=0,wlen = 0;
    int err;
 
-   if (f->flags & VMFS_FILE_FLAG_FD)
-      return(-EIO);
-
-   if (!vmfs_fs_readwrite(fs))
-      return(-EROFS);
-
    /* We don't handle RDM files */
    if (f->inode->type == VMFS_FILE_TYPE_RDM)
       return(-EIO);
@@ -302,44 +437,321 @@ ssize_t vmfs_file_pwrite(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
    return(wlen);
 }
 
-/* Dump a file */
-int vmfs_file_dump(vmfs_file_t *f,off_t pos,uint64_t len,FILE *fd_out)
+/* Write data to a file at the specified position */
+ssize_t vmfs_file_pwrite(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
 {
+   ssize_t res;
+
+   if (f->flags & VMFS_FILE_FLAG_FD)
+      return(-EIO);
+
+   if (!vmfs_fs_readwrite(vmfs_file_get_fs(f)))
+      return(-EROFS);
+
+   vmfs_inode_lock(f->inode);
+   res = vmfs_file_pwrite_inode(f,buf,len,pos);
+   vmfs_inode_unlock(f->inode);
+   return(res);
+}
+
+/* Get the extent of a file starting at the specified position */
+int vmfs_file_get_extent(vmfs_file_t *f,off_t pos,int physical,
+                         vmfs_extent_t *ext)
+{
+   int res;
+
+   if (f->flags & VMFS_FILE_FLAG_FD)
+      return(-EIO);
+
+   if (!vmfs_fs_readwrite(vmfs_file_get_fs(f)))
+      return(vmfs_inode_get_extent(f->inode,pos,physical,ext));
+
+   vmfs_inode_lock(f->inode);
+   res = vmfs_inode_get_extent(f->inode,pos,physical,ext);
+   vmfs_inode_unlock(f->inode);
+   return(res);
+}
+
+/* 
+ * Get the first position holding data from the specified position, like
+ * lseek(SEEK_DATA). Unallocated and TBZ blocks are holes.
+ */
+off_t vmfs_file_seek_data(vmfs_file_t *f,off_t pos)
+{
+   vmfs_extent_t ext;
+   int res;
+
+   do {
+      if ((res = vmfs_file_get_extent(f,pos,0,&ext)) < 0)
+         return(res);
+
+      if (ext.type == VMFS_EXTENT_DATA)
+         return(pos);
+
+      pos += ext.len;
+   } while(1);
+}
+
+/* 
+ * Get the first hole from the specified position, like lseek(SEEK_HOLE).
+ * There is always a hole at the end of the file.
+ */
+off_t vmfs_file_seek_hole(vmfs_file_t *f,off_t pos)
+{
+   vmfs_extent_t ext;
+   int res;
+
+   if ((res = vmfs_file_get_extent(f,pos,0,&ext)) < 0)
+      return(res);
+
+   if (ext.type == VMFS_EXTENT_DATA)
+      pos += ext.len;
+
+   return(pos);
+}
+
+/* Chunk of file data being dumped */
+struct vmfs_file_dump_chunk {
    u_char *buf;
+   ssize_t len;      /* Amount of data, negative on read error */
+   int fd;           /* Host file holding the data when mapped, or -1 */
+   off_t fd_pos;
+};
+
+/* File dump state shared between the reader and the writer */
+struct vmfs_file_dump {
+   vmfs_file_t *f;
+   off_t pos,end;
+   size_t chunk_size;
+   struct vmfs_file_dump_chunk *chunks;
+   u_int count,head,tail,filled;
+   int done,abort;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+};
+
+/* Read chunks ahead of the writer, until the ring is full */
+static void *vmfs_file_dump_reader(void *arg)
+{
+   struct vmfs_file_dump *d = arg;
+   struct vmfs_file_dump_chunk *c;
+   ssize_t len;
+   off_t pos;
+   int abort;
+
+   for(pos=d->pos;pos<d->end;pos+=len) {
+      pthread_mutex_lock(&d->lock);
+      while((d->filled == d->count) && !d->abort)
+         pthread_cond_wait(&d->cond,&d->lock);
+      c = &d->chunks[d->head];
+      abort = d->abort;
+      pthread_mutex_unlock(&d->lock);
+
+      if (abort)
+         break;
+
+      len = m_min(d->chunk_size,d->end - pos);
+
+      /* Data stored as is on the host doesn't need to be read here */
+      c->len = vmfs_file_map(d->f,pos,len,&c->fd,&c->fd_pos);
+      if (c->len <= 0) {
+         c->fd = -1;
+         c->len = vmfs_file_pread(d->f,c->buf,len,pos);
+      }
+      len = c->len;
+
+      pthread_mutex_lock(&d->lock);
+      d->head = (d->head + 1) % d->count;
+      d->filled++;
+      pthread_cond_broadcast(&d->cond);
+      pthread_mutex_unlock(&d->lock);
+
+      if (len <= 0)
+         break;
+   }
+
+   pthread_mutex_lock(&d->lock);
+   d->done = 1;
+   pthread_cond_broadcast(&d->cond);
+   pthread_mutex_unlock(&d->lock);
+   return NULL;
+}
+
+/* Write a buffer to a file descriptor */
+static int vmfs_file_dump_write(int fd,const u_char *buf,size_t len)
+{
    ssize_t res;
-   size_t clen,buf_len;
+
+   while(len > 0) {
+      if ((res = write(fd,buf,len)) <= 0) {
+         if ((res < 0) && (errno == EINTR))
+            continue;
+         return(-1);
+      }
+      buf += res;
+      len -= res;
+   }
+   return(0);
+}
+
+/* 
+ * Copy data from a host file to the output without going through user
+ * space. Returns the amount of data copied, or -1 when it isn't possible.
+ */
+static ssize_t vmfs_file_dump_copy(int fd_in,off_t pos,int fd_out,
+                                   size_t len,int out_is_pipe)
+{
+   size_t done = 0;
+   ssize_t res;
+
+   while(done < len) {
+#ifndef NO_SPLICE
+      if (out_is_pipe)
+         res = splice(fd_in,&pos,fd_out,NULL,len-done,SPLICE_F_MORE);
+      else
+#endif
+#ifndef NO_COPY_FILE_RANGE
+      if (!out_is_pipe)
+         res = copy_file_range(fd_in,&pos,fd_out,NULL,len-done,0);
+      else
+#endif
+         res = -1;
+
+      if (res <= 0) {
+         if ((res < 0) && (errno == EINTR))
+            continue;
+         break;
+      }
+      done += res;
+   }
+
+   return(done ? done : -1);
+}
+
+/* 
+ * Dump a file to a file descriptor. A reader thread keeps up to the given
+ * number of chunks of the given size ahead of the writes, so that reads and
+ * writes overlap. Data stored as is in host files is copied by the kernel
+ * when possible.
+ */
+int vmfs_file_dump_fd(vmfs_file_t *f,off_t pos,uint64_t len,int fd_out,
+                      size_t chunk_size,u_int chunks)
+{
+   struct vmfs_file_dump d;
+   struct vmfs_file_dump_chunk *c;
+   pthread_t reader;
+   struct stat st;
+   int zero_copy,out_is_pipe,filled;
+   ssize_t res;
+   int ret = -1;
+   u_int i;
 
    if (f->flags & VMFS_FILE_FLAG_FD)
       return(-EIO);
 
-   if (!len)
-      len = vmfs_file_get_size(f);
+   memset(&d,0,sizeof(d));
+   d.f = f;
+   d.pos = pos;
+   d.end = vmfs_file_get_size(f);
+   if (len && (pos + len < d.end))
+      d.end = pos + len;
+   d.chunk_size = chunk_size ? chunk_size : VMFS_FILE_DUMP_CHUNK_SIZE;
+   d.count = chunks ? chunks : VMFS_FILE_DUMP_CHUNKS;
 
-   buf_len = 0x100000;
+   if (pos >= d.end)
+      return(0);
 
-   if (!(buf = iobuffer_alloc(buf_len)))
+   if (!(d.chunks = calloc(d.count,sizeof(*d.chunks))))
       return(-1);
 
-   for(;pos < len; pos+=clen) {
-      clen = m_min(len,buf_len);
-      res = vmfs_file_pread(f,buf,clen,pos);
+   for(i=0;i<d.count;i++)
+      if (!(d.chunks[i].buf = iobuffer_alloc(d.chunk_size)))
+         goto free_chunks;
+
+   out_is_pipe = !fstat(fd_out,&st) && S_ISFIFO(st.st_mode);
+   zero_copy = 1;
+
+   pthread_mutex_init(&d.lock,NULL);
+   pthread_cond_init(&d.cond,NULL);
+
+   if (pthread_create(&reader,NULL,vmfs_file_dump_reader,&d))
+      goto destroy_lock;
+
+   for(;;) {
+      pthread_mutex_lock(&d.lock);
+      while(!d.filled && !d.done)
+         pthread_cond_wait(&d.cond,&d.lock);
+      c = &d.chunks[d.tail];
+      filled = d.filled;
+      pthread_mutex_unlock(&d.lock);
 
-      if (res < 0) {
+      if (!filled)
+         break;
+
+      if (c->len < 0) {
          fprintf(stderr,"vmfs_file_dump: problem reading input file.\n");
-         return(-1);
+         break;
       }
 
-      if (fwrite(buf,1,res,fd_out) != res) {
-         fprintf(stderr,"vmfs_file_dump: error writing output file.\n");
-         return(-1);
+      if (c->fd != -1) {
+         res = zero_copy ?
+                  vmfs_file_dump_copy(c->fd,c->fd_pos,fd_out,c->len,
+                                      out_is_pipe) : -1;
+
+         /* Copy the remainder through the chunk buffer otherwise */
+         if (res < c->len) {
+            if (res < 0) {
+               zero_copy = 0;
+               res = 0;
+            }
+            c->fd_pos += res;
+            c->len -= res;
+            if (m_pread(c->fd,c->buf,c->len,c->fd_pos) != c->len) {
+               fprintf(stderr,"vmfs_file_dump: problem reading input file.\n");
+               break;
+            }
+            c->fd = -1;
+         }
       }
 
-      if (res < clen)
+      if ((c->fd == -1) && vmfs_file_dump_write(fd_out,c->buf,c->len)) {
+         fprintf(stderr,"vmfs_file_dump: error writing output file.\n");
          break;
+      }
+
+      pthread_mutex_lock(&d.lock);
+      d.tail = (d.tail + 1) % d.count;
+      d.filled--;
+      pthread_cond_broadcast(&d.cond);
+      pthread_mutex_unlock(&d.lock);
    }
 
-   free(buf);
-   return(0);
+   pthread_mutex_lock(&d.lock);
+   if (!d.done || d.filled) {
+      d.abort = 1;
+      pthread_cond_broadcast(&d.cond);
+   } else {
+      ret = 0;
+   }
+   pthread_mutex_unlock(&d.lock);
+
+   pthread_join(reader,NULL);
+
+ destroy_lock:
+   pthread_cond_destroy(&d.cond);
+   pthread_mutex_destroy(&d.lock);
+ free_chunks:
+   for(i=0;i<d.count;i++)
+      iobuffer_free(d.chunks[i].buf);
+   free(d.chunks);
+   return(ret);
+}
+
+/* Dump a file */
+int vmfs_file_dump(vmfs_file_t *f,off_t pos,uint64_t len,FILE *fd_out)
+{
+   fflush(fd_out);
+   return(vmfs_file_dump_fd(f,pos,len,fileno(fd_out),0,0));
 }
 
 /* Get file status */
@@ -389,6 +801,15 @@ int vmfs_file_lstat_at(vmfs_dir_t *dir,const char *path,struct stat *buf)
                                      entry->block_id,buf));
 }
 
+/* Write the pending metadata changes of a file to disk */
+int vmfs_file_sync(vmfs_file_t *f)
+{
+   if (f->flags & VMFS_FILE_FLAG_FD)
+      return(0);
+
+   return((vmfs_inode_sync(f->inode) == -1) ? -EIO : 0);
+}
+
 /* Truncate a file (using a file descriptor) */
 int vmfs_file_truncate(vmfs_file_t *f,off_t length)
 {
@@ -442,14 +863,21 @@ int vmfs_file_delete(vmfs_dir_t *dir,const char *name)
 {
    vmfs_dirent_t *entry;
    off_t pos;
+   int res;
 
-   if (!(entry = (vmfs_dirent_t *)vmfs_dir_lookup(dir,name)))
-      return(-ENOENT);
-
-   if ((entry->type != VMFS_FILE_TYPE_FILE) &&
-       (entry->type != VMFS_FILE_TYPE_SYMLINK))
-      return(-EPERM);
+   /* Keep the entry position valid until it is unlinked */
+   vmfs_inode_lock(dir->dir->inode);
+
+   if (!(entry = (vmfs_dirent_t *)vmfs_dir_lookup(dir,name))) {
+      res = -ENOENT;
+   } else if ((entry->type != VMFS_FILE_TYPE_FILE) &&
+              (entry->type != VMFS_FILE_TYPE_SYMLINK)) {
+      res = -EPERM;
+   } else {
+      pos = (dir->pos - 1) * VMFS_DIRENT_SIZE;
+      res = vmfs_dir_unlink_inode(dir,pos,entry);
+   }
 
-   pos = (dir->pos - 1) * VMFS_DIRENT_SIZE;
-   return(vmfs_dir_unlink_inode(dir,pos,entry));
+   vmfs_inode_unlock(dir->dir->inode);
+   return(res);
 }
@@ -93,9 +93,31 @@ int vmfs_file_close(vmfs_file_t *f);
 /* Read data from a file at the specified position */
 ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos);
 
+/* Get the host file descriptor and offset of file data */
+ssize_t vmfs_file_map(vmfs_file_t *f,off_t pos,size_t len,
+                      int *fd,off_t *fd_pos);
+
 /* Write data to a file at the specified position */
 ssize_t vmfs_file_pwrite(vmfs_file_t *f,u_char *buf,size_t len,off_t pos);
 
+/* Get the extent of a file starting at the specified position */
+int vmfs_file_get_extent(vmfs_file_t *f,off_t pos,int physical,
+                         vmfs_extent_t *ext);
+
+/* Get the first position holding data from the specified position */
+off_t vmfs_file_seek_data(vmfs_file_t *f,off_t pos);
+
+/* Get the first hole from the specified position */
+off_t vmfs_file_seek_hole(vmfs_file_t *f,off_t pos);
+
+/* Default chunk size and number of chunks read ahead for file dumps */
+#define VMFS_FILE_DUMP_CHUNK_SIZE  0x100000
+#define VMFS_FILE_DUMP_CHUNKS      4
+
+/* Dump a file to a file descriptor */
+int vmfs_file_dump_fd(vmfs_file_t *f,off_t pos,uint64_t len,int fd_out,
+                      size_t chunk_size,u_int chunks);
+
 /* Dump a file */
 int vmfs_file_dump(vmfs_file_t *f,off_t pos,uint64_t len,FILE *fd_out);
 
@@ -108,6 +130,9 @@ int vmfs_file_stat_at(vmfs_dir_t *dir,const char *path,struct stat *buf);
 /* Get file file status (do not follow symlink) */
 int vmfs_file_lstat_at(vmfs_dir_t *dir,const char *path,struct stat *buf);
 
+/* Write the pending metadata changes of a file to disk */
+int vmfs_file_sync(vmfs_file_t *f);
+
 /* Truncate a file (using a file descriptor) */
 int vmfs_file_truncate(vmfs_file_t *f,off_t length);
 
@@ -214,6 +214,32 @@ static vmfs_device_t *vmfs_device_open(char **paths, vmfs_flags_t flags)
    return &lvm->dev;
 }
 
+/* Initialize the locks of a filesystem */
+static void vmfs_fs_init_locks(vmfs_fs_t *fs)
+{
+   int i;
+
+   pthread_mutex_init(&fs->hb_lock,NULL);
+   m_mutex_init_recursive(&fs->alloc_lock);
+   pthread_mutex_init(&fs->dentry_lock,NULL);
+
+   for(i=0;i<VMFS_INODE_HASH_BUCKETS;i++)
+      pthread_mutex_init(&fs->inode_locks[i],NULL);
+}
+
+/* Destroy the locks of a filesystem */
+static void vmfs_fs_destroy_locks(vmfs_fs_t *fs)
+{
+   int i;
+
+   pthread_mutex_destroy(&fs->hb_lock);
+   pthread_mutex_destroy(&fs->alloc_lock);
+   pthread_mutex_destroy(&fs->dentry_lock);
+
+   for(i=0;i<VMFS_INODE_HASH_BUCKETS;i++)
+      pthread_mutex_destroy(&fs->inode_locks[i]);
+}
+
 /* Open a filesystem */
 vmfs_fs_t *vmfs_fs_open(char **paths, vmfs_flags_t flags)
 {
@@ -230,11 +256,18 @@ vmfs_fs_t *vmfs_fs_open(char **paths, vmfs_flags_t flags)
    fs->inode_hash_buckets = VMFS_INODE_HASH_BUCKETS;
    fs->inodes = calloc(fs->inode_hash_buckets,sizeof(vmfs_inode_t *));
 
-   if (!fs->inodes) {
+   fs->dentry_hash_buckets = VMFS_DENTRY_HASH_BUCKETS;
+   fs->dentries = calloc(fs->dentry_hash_buckets,sizeof(vmfs_dentry_t *));
+
+   if (!fs->inodes || !fs->dentries) {
+      free(fs->inodes);
+      free(fs->dentries);
       free(fs);
       return NULL;
    }
 
+   vmfs_fs_init_locks(fs);
+
    fs->dev = dev;
    fs->debug_level = flags.debug_level;
 
@@ -284,6 +317,67 @@ static void vmfs_fs_sync_inodes(vmfs_fs_t *fs)
    }
 }
 
+/* 
+ * Get the number of allocated items in a bitmap, from cached counters.
+ * The counters are initialized with a full scan of the bitmap, and
+ * rescanned periodically to catch changes made by other hosts. Scans are
+ * done without the allocator lock, so that allocations don't wait for
+ * them; allocations made meanwhile are caught up by the next scan.
+ */
+uint32_t vmfs_fs_get_allocated_items(const vmfs_fs_t *fs,
+                                     enum vmfs_block_type type)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+   vmfs_bitmap_t *bmp;
+   uint32_t res;
+   uint64_t now,expire;
+
+   if (!(bmp = vmfs_fs_get_bitmap(fs,type)))
+      return(0);
+
+   pthread_mutex_lock(&wfs->alloc_lock);
+   now = vmfs_host_get_uptime();
+   expire = fs->alloc_items_expire[type];
+   res = fs->alloc_items[type];
+
+   /* Other threads keep using the current counter while it is refreshed */
+   if (expire && (now < expire)) {
+      pthread_mutex_unlock(&wfs->alloc_lock);
+      return(res);
+   }
+
+   if (expire)
+      wfs->alloc_items_expire[type] = now + VMFS_FS_ALLOC_REFRESH_DELAY;
+
+   pthread_mutex_unlock(&wfs->alloc_lock);
+
+   res = vmfs_bitmap_allocated_items(bmp);
+
+   pthread_mutex_lock(&wfs->alloc_lock);
+   wfs->alloc_items[type] = res;
+   wfs->alloc_items_expire[type] = now + VMFS_FS_ALLOC_REFRESH_DELAY;
+   pthread_mutex_unlock(&wfs->alloc_lock);
+   return(res);
+}
+
+/* Account for items allocated (positive delta) or freed (negative delta) */
+void vmfs_fs_update_allocated_items(const vmfs_fs_t *fs,
+                                    enum vmfs_block_type type,int delta)
+{
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
+
+   /* Counters not initialized yet, the first scan will account for it */
+   if ((type <= VMFS_BLK_TYPE_NONE) || (type >= VMFS_BLK_TYPE_MAX))
+      return;
+
+   pthread_mutex_lock(&wfs->alloc_lock);
+
+   if (fs->alloc_items_expire[type])
+      wfs->alloc_items[type] += delta;
+
+   pthread_mutex_unlock(&wfs->alloc_lock);
+}
+
 /* Close a FS */
 void vmfs_fs_close(vmfs_fs_t *fs)
 {
@@ -305,8 +399,12 @@ void vmfs_fs_close(vmfs_fs_t *fs)
 
    vmfs_fs_sync_inodes(fs);
 
+   vmfs_dentry_cache_flush(fs);
+
    vmfs_device_close(fs->dev);
+   vmfs_fs_destroy_locks(fs);
    free(fs->inodes);
+   free(fs->dentries);
    free(fs->fs_info.label);
    free(fs);
 }
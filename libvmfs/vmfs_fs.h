@@ -82,6 +82,14 @@ struct vmfs_fsinfo {
 /* === VMFS filesystem === */
 #define VMFS_INODE_HASH_BUCKETS  256
 
+/* Dentry cache size, and delay (in usecs) after which entries expire */
+#define VMFS_DENTRY_HASH_BUCKETS  1024
+#define VMFS_DENTRY_CACHE_SIZE    8192
+#define VMFS_DENTRY_EXPIRE_DELAY  (30 * 1000000)
+
+/* Delay (in usecs) after which cached allocation counters are rescanned */
+#define VMFS_FS_ALLOC_REFRESH_DELAY  (10 * 1000000)
+
 struct vmfs_fs {
    int debug_level;
 
@@ -94,19 +102,38 @@ struct vmfs_fs {
    /* Meta-files containing file system structures */
    vmfs_bitmap_t *fbb,*sbc,*pbc,*fdc;
 
-   /* Heartbeat used to lock meta-data */
+   /* Heartbeat used to lock meta-data, protected by hb_lock */
+   pthread_mutex_t hb_lock;
    vmfs_heartbeat_t hb;
    u_int hb_id;
    uint64_t hb_seq;
    u_int hb_refcount;
    uint64_t hb_expire;
 
+   /*
+    * Allocator lock, protecting block allocation, the allocated items
+    * counters and the "gen" field counter
+    */
+   pthread_mutex_t alloc_lock;
+
    /* Counter for "gen" field in inodes */
    uint32_t inode_gen;
 
-   /* In-core inodes hash table */
+   /* In-core inodes hash table, with a lock for each bucket */
    u_int inode_hash_buckets;
    vmfs_inode_t **inodes;
+   pthread_mutex_t inode_locks[VMFS_INODE_HASH_BUCKETS];
+
+   /* Dentry cache, with entries in least recently used order */
+   pthread_mutex_t dentry_lock;
+   u_int dentry_hash_buckets;
+   vmfs_dentry_t **dentries;
+   vmfs_dentry_t *dentry_lru_first,*dentry_lru_last;
+   u_int dentry_count;
+
+   /* Cached allocated items counters for each bitmap */
+   uint32_t alloc_items[VMFS_BLK_TYPE_MAX];
+   uint64_t alloc_items_expire[VMFS_BLK_TYPE_MAX];
 };
 
 /* Get the bitmap corresponding to the given type */
@@ -140,6 +167,14 @@ ssize_t vmfs_fs_read(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
 ssize_t vmfs_fs_write(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
                       const u_char *buf,size_t len);
 
+/* Get the number of allocated items in a bitmap, from cached counters */
+uint32_t vmfs_fs_get_allocated_items(const vmfs_fs_t *fs,
+                                     enum vmfs_block_type type);
+
+/* Account for items allocated (positive delta) or freed (negative delta) */
+void vmfs_fs_update_allocated_items(const vmfs_fs_t *fs,
+                                    enum vmfs_block_type type,int delta);
+
 /* Open a FS */
 vmfs_fs_t *vmfs_fs_open(char **paths, vmfs_flags_t flags);
 
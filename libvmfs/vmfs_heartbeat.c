@@ -175,8 +175,8 @@ int vmfs_heartbeat_update(vmfs_fs_t *fs,vmfs_heartbeat_t *hb)
    return((vmfs_device_write(fs->dev,hb->pos,buf,buf_len) == buf_len) ? 0 : -1);
 }
 
-/* Acquire an heartbeat (ID is chosen automatically) */
-int vmfs_heartbeat_acquire(vmfs_fs_t *fs)
+/* Acquire an heartbeat, with hb_lock held */
+static int vmfs_heartbeat_acquire_locked(vmfs_fs_t *fs)
 {
    vmfs_heartbeat_t hb;   
    u_char *buf;
@@ -228,13 +228,30 @@ int vmfs_heartbeat_acquire(vmfs_fs_t *fs)
    return(res);
 }
 
+/* Acquire an heartbeat (ID is chosen automatically) */
+int vmfs_heartbeat_acquire(vmfs_fs_t *fs)
+{
+   int res;
+
+   pthread_mutex_lock(&fs->hb_lock);
+   res = vmfs_heartbeat_acquire_locked(fs);
+   pthread_mutex_unlock(&fs->hb_lock);
+   return(res);
+}
+
 /* Release an heartbeat */
 int vmfs_heartbeat_release(vmfs_fs_t *fs)
 {
-   if (fs->hb_refcount == 0)
-      return(-1);
+   int res = -1;
+
+   pthread_mutex_lock(&fs->hb_lock);
 
    /* The heartbeat will be eventually released by the background process */
-   fs->hb_refcount--;
-   return(0);
+   if (fs->hb_refcount > 0) {
+      fs->hb_refcount--;
+      res = 0;
+   }
+
+   pthread_mutex_unlock(&fs->hb_lock);
+   return(res);
 }
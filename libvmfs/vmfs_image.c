@@ -0,0 +1,397 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* 
+ * Read-only access to images created by imager. The image format is
+ * described in imager/imager.c. Images with an index (format version 3)
+ * are opened directly, others are scanned once to build the index. Reads
+ * then start from the closest indexed sequence, or from the last decoded
+ * one for sequential accesses.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "vmfs.h"
+
+/* Maximum size of a sequence */
+#define VMFS_IMAGE_MAX_SEQ  (1 + 5 + VMFS_IMAGE_BLK_SIZE)
+
+/* Size of the index trailer */
+#define VMFS_IMAGE_TRAILER_SIZE  24
+
+/* Size of an index entry */
+#define VMFS_IMAGE_INDEX_ENTRY_SIZE  16
+
+/* Make the image data at the given position available in the buffer */
+static ssize_t vmfs_image_fetch(vmfs_image_t *img,off_t pos,size_t len,
+                                const u_char **data)
+{
+   ssize_t res;
+
+   if ((pos < img->buf_pos) || (pos + len > img->buf_pos + img->buf_len)) {
+      if ((res = m_pread(img->fd,img->buf,VMFS_IMAGE_BUF_SIZE,pos)) < 0)
+         return(-EIO);
+      img->buf_pos = pos;
+      img->buf_len = res;
+   }
+
+   *data = img->buf + (pos - img->buf_pos);
+   return(m_min(len,img->buf_pos + img->buf_len - pos));
+}
+
+/* Read a variable-length number, returning the number of bytes it uses */
+static int vmfs_image_get_number(const u_char *p,size_t len,uint32_t *num)
+{
+   int i;
+
+   for(i=0,*num=0;(i < len) && (i < 5);i++) {
+      *num |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+      if (!(p[i] & 0x80))
+         return(i + 1);
+   }
+
+   return(-1);
+}
+
+/* Move the cursor to the sequence at the given position */
+static inline void vmfs_image_rewind(vmfs_image_t *img,uint64_t blk,off_t pos)
+{
+   img->cur_blk  = blk;
+   img->cur_len  = 0;
+   img->next_pos = pos;
+}
+
+/* 
+ * Decode the sequence following the cursor. Returns 1 on success, 0 at the
+ * end of the sequences.
+ */
+static int vmfs_image_decode(vmfs_image_t *img)
+{
+   const u_char *p;
+   ssize_t len;
+   uint64_t seq_len;
+   size_t size;
+   uint32_t num;
+   int n;
+
+   for(;;) {
+      len = vmfs_image_fetch(img,img->next_pos,VMFS_IMAGE_MAX_SEQ,&p);
+      if (len <= 0)
+         return(len);
+
+      switch(p[0]) {
+         case 0x00:
+            if (img->version >= 2) {
+               n = vmfs_image_get_number(p+1,len-1,&num);
+               if ((n < 0) || (num > VMFS_IMAGE_BLK_SIZE / 4) ||
+                   (1 + n + num * 4 > len))
+                  return(-EIO);
+               memcpy(img->blk,p+1+n,num * 4);
+               memset(img->blk + num * 4,0,VMFS_IMAGE_BLK_SIZE - num * 4);
+               size = 1 + n + num * 4;
+            } else {
+               if (len < 1 + VMFS_IMAGE_BLK_SIZE)
+                  return(-EIO);
+               memcpy(img->blk,p+1,VMFS_IMAGE_BLK_SIZE);
+               size = 1 + VMFS_IMAGE_BLK_SIZE;
+            }
+            img->cur_raw = 1;
+            seq_len = 1;
+            break;
+
+         case 0x01:
+            if ((n = vmfs_image_get_number(p+1,len-1,&num)) < 0)
+               return(-EIO);
+            img->cur_raw = 0;
+            seq_len = (uint64_t)num + 1;
+            size = 1 + n;
+            break;
+
+         case 0x7f:
+            /* Checksums are only useful when reading the whole image */
+            if (len < 5)
+               return(-EIO);
+            img->next_pos += 5;
+            continue;
+
+         case 0x7e:
+            if (img->version >= 3)
+               return(0);
+            /* Fall through */
+
+         default:
+            return(-EIO);
+      }
+
+      img->cur_blk += img->cur_len;
+      img->cur_len  = seq_len;
+      img->cur_pos  = img->next_pos;
+      img->next_pos += size;
+      return(1);
+   }
+}
+
+/* Find the last index entry at or before the given block */
+static struct vmfs_image_index *
+vmfs_image_find_index(const vmfs_image_t *img,uint64_t blk)
+{
+   size_t lo = 0, hi = img->index_count, mid;
+
+   while(hi - lo > 1) {
+      mid = (lo + hi) / 2;
+      if (img->index[mid].blk <= blk)
+         lo = mid;
+      else
+         hi = mid;
+   }
+
+   return(&img->index[lo]);
+}
+
+/* Move the cursor to the sequence containing the given block */
+static int vmfs_image_seek(vmfs_image_t *img,uint64_t blk)
+{
+   struct vmfs_image_index *idx;
+   int res;
+
+   if ((blk >= img->cur_blk) && (blk - img->cur_blk < img->cur_len))
+      return(0);
+
+   /* Restart from the index, unless the cursor is closer */
+   idx = vmfs_image_find_index(img,blk);
+   if ((blk < img->cur_blk) || (idx->pos > img->next_pos))
+      vmfs_image_rewind(img,idx->blk,idx->pos);
+
+   while(blk - img->cur_blk >= img->cur_len) {
+      if ((res = vmfs_image_decode(img)) <= 0)
+         return(res ? res : -EIO);
+   }
+
+   return(0);
+}
+
+/* Read data from an image */
+static ssize_t vmfs_image_read(const vmfs_device_t *dev,off_t pos,
+                               u_char *buf,size_t len)
+{
+   vmfs_image_t *img = (vmfs_image_t *)dev;
+   uint64_t blk,ofs;
+   size_t done = 0,n;
+   int res = 0;
+
+   pthread_mutex_lock(&img->lock);
+
+   while(done < len) {
+      blk = (pos + done) / VMFS_IMAGE_BLK_SIZE;
+      if (blk >= img->blocks)
+         break;
+
+      if ((res = vmfs_image_seek(img,blk)) < 0)
+         break;
+
+      ofs = pos + done - img->cur_blk * VMFS_IMAGE_BLK_SIZE;
+      n = m_min(len - done,img->cur_len * VMFS_IMAGE_BLK_SIZE - ofs);
+
+      if (img->cur_raw)
+         memcpy(buf + done,img->blk + ofs,n);
+      else
+         memset(buf + done,0,n);
+
+      done += n;
+   }
+
+   pthread_mutex_unlock(&img->lock);
+   return((res < 0) ? -1 : done);
+}
+
+/* Add an entry to the index */
+static int vmfs_image_add_index(vmfs_image_t *img,size_t *size,
+                                uint64_t blk,off_t pos)
+{
+   struct vmfs_image_index *index;
+
+   if (img->index_count == *size) {
+      *size = *size ? *size * 2 : 256;
+      if (!(index = realloc(img->index,*size * sizeof(*index))))
+         return(-ENOMEM);
+      img->index = index;
+   }
+
+   img->index[img->index_count].blk = blk;
+   img->index[img->index_count].pos = pos;
+   img->index_count++;
+   return(0);
+}
+
+/* Load the index stored at the end of an image */
+static int vmfs_image_load_index(vmfs_image_t *img)
+{
+   u_char trailer[VMFS_IMAGE_TRAILER_SIZE];
+   u_char *buf;
+   struct stat st;
+   off_t index_pos;
+   uint64_t count,i;
+   size_t buf_len,size = 0;
+   int res = -EIO;
+
+   if (fstat(img->fd,&st) ||
+       (st.st_size < 9 + VMFS_IMAGE_TRAILER_SIZE) ||
+       (m_pread(img->fd,trailer,sizeof(trailer),
+                st.st_size - sizeof(trailer)) != sizeof(trailer)))
+      return(-EIO);
+
+   index_pos   = read_le64(trailer,0);
+   count       = read_le64(trailer,8);
+   img->blocks = read_le64(trailer,16);
+
+   if ((index_pos < 8) || (count > st.st_size / VMFS_IMAGE_INDEX_ENTRY_SIZE) ||
+       (index_pos + 1 + count * VMFS_IMAGE_INDEX_ENTRY_SIZE +
+        VMFS_IMAGE_TRAILER_SIZE != st.st_size))
+      return(-EIO);
+
+   buf_len = 1 + count * VMFS_IMAGE_INDEX_ENTRY_SIZE;
+   if (!(buf = malloc(buf_len)))
+      return(-ENOMEM);
+
+   if ((m_pread(img->fd,buf,buf_len,index_pos) != buf_len) || (buf[0] != 0x7e))
+      goto done;
+
+   /* The first sequence is always indexed, even if the index is empty */
+   if ((res = vmfs_image_add_index(img,&size,0,8)) < 0)
+      goto done;
+
+   for(i=0;i<count;i++) {
+      uint64_t blk = read_le64(buf,1 + i * VMFS_IMAGE_INDEX_ENTRY_SIZE);
+      off_t pos = read_le64(buf,9 + i * VMFS_IMAGE_INDEX_ENTRY_SIZE);
+
+      if ((blk < img->index[img->index_count-1].blk) ||
+          (pos < img->index[img->index_count-1].pos) || (pos >= index_pos)) {
+         res = -EIO;
+         goto done;
+      }
+
+      if ((res = vmfs_image_add_index(img,&size,blk,pos)) < 0)
+         goto done;
+   }
+
+ done:
+   free(buf);
+   return(res);
+}
+
+/* Build the index of an image without one, by decoding all its sequences */
+static int vmfs_image_scan(vmfs_image_t *img)
+{
+   uint64_t seq;
+   size_t size = 0;
+   int res;
+
+   for(seq=0;(res = vmfs_image_decode(img)) > 0;seq++) {
+      if (seq % VMFS_IMAGE_INDEX_INTERVAL)
+         continue;
+      if ((res = vmfs_image_add_index(img,&size,img->cur_blk,img->cur_pos)) < 0)
+         return(res);
+   }
+
+   if (res < 0)
+      return(res);
+
+   img->blocks = img->cur_blk + img->cur_len;
+
+   if (!img->index_count)
+      return(vmfs_image_add_index(img,&size,0,8));
+
+   return(0);
+}
+
+/* Close an image */
+static void vmfs_image_close(vmfs_device_t *dev)
+{
+   vmfs_image_t *img = (vmfs_image_t *)dev;
+
+   if (!img)
+      return;
+
+   close(img->fd);
+   pthread_mutex_destroy(&img->lock);
+   free(img->index);
+   free(img->buf);
+   free(img);
+}
+
+/* Check whether a file descriptor refers to an image */
+bool vmfs_image_probe(int fd)
+{
+   u_char hdr[8];
+
+   return((m_pread(fd,hdr,sizeof(hdr),0) == sizeof(hdr)) &&
+          !memcmp(hdr,"VMFSIMG",7));
+}
+
+/* Open an image from a file descriptor, which is closed with the image */
+vmfs_image_t *vmfs_image_open(int fd)
+{
+   vmfs_image_t *img;
+   u_char hdr[8];
+   int res;
+
+   if ((m_pread(fd,hdr,sizeof(hdr),0) != sizeof(hdr)) ||
+       memcmp(hdr,"VMFSIMG",7))
+      return NULL;
+
+   if (hdr[7] > VMFS_IMAGE_VERSION) {
+      fprintf(stderr,"VMFS: Unsupported image format version %u\n",hdr[7]);
+      return NULL;
+   }
+
+   if (!(img = calloc(1,sizeof(*img))))
+      return NULL;
+
+   if (!(img->buf = malloc(VMFS_IMAGE_BUF_SIZE))) {
+      free(img);
+      return NULL;
+   }
+
+   img->fd = fd;
+   img->version = hdr[7];
+   pthread_mutex_init(&img->lock,NULL);
+   vmfs_image_rewind(img,0,8);
+
+   if (img->version >= 3)
+      res = vmfs_image_load_index(img);
+   else
+      res = vmfs_image_scan(img);
+
+   if (res < 0) {
+      fprintf(stderr,"VMFS: Unable to read image index: %s\n",strerror(-res));
+      pthread_mutex_destroy(&img->lock);
+      free(img->index);
+      free(img->buf);
+      free(img);
+      return NULL;
+   }
+
+   vmfs_image_rewind(img,0,8);
+
+   img->dev.read = vmfs_image_read;
+   img->dev.close = vmfs_image_close;
+
+   return img;
+}
@@ -0,0 +1,73 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ * Copyright (C) 2009 Christophe Fillot <cf@utc.fr>
+ * Copyright (C) 2009 Mike Hommey <mh@glandium.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef VMFS_IMAGE_H
+#define VMFS_IMAGE_H
+
+/* Highest supported image format version */
+#define VMFS_IMAGE_VERSION  3
+
+/* Size of an image block */
+#define VMFS_IMAGE_BLK_SIZE  512
+
+/* Size of the buffer the image file is read with */
+#define VMFS_IMAGE_BUF_SIZE  0x10000
+
+/* Number of sequences between two index entries of unindexed images */
+#define VMFS_IMAGE_INDEX_INTERVAL  64
+
+/* Index entry, giving where a sequence starts */
+struct vmfs_image_index {
+   uint64_t blk;
+   off_t pos;
+};
+
+/* === Image created by imager, used as a read-only device === */
+struct vmfs_image {
+   vmfs_device_t dev;
+   int fd;
+   u_int version;
+
+   /* Total number of blocks */
+   uint64_t blocks;
+
+   /* Sequence index, sorted by block */
+   struct vmfs_image_index *index;
+   size_t index_count;
+
+   /* Lock protecting the buffer and the cursor below */
+   pthread_mutex_t lock;
+
+   /* Buffered image data */
+   u_char *buf;
+   off_t buf_pos;
+   size_t buf_len;
+
+   /* Last decoded sequence and offset of the next one */
+   uint64_t cur_blk,cur_len;
+   int cur_raw;
+   off_t cur_pos,next_pos;
+   u_char blk[VMFS_IMAGE_BLK_SIZE];
+};
+
+/* Check whether a file descriptor refers to an image */
+bool vmfs_image_probe(int fd);
+
+/* Open an image from a file descriptor, which is closed with the image */
+vmfs_image_t *vmfs_image_open(int fd);
+
+#endif
@@ -154,7 +154,8 @@ static inline u_int vmfs_inode_hash(const vmfs_fs_t *fs,uint32_t blk_id)
    return( (blk_id ^ (blk_id >> 9)) & (fs->inode_hash_buckets - 1) );
 }
 
-/* Register an inode in the in-core inode hash table */
+/* Register an inode in the in-core inode hash table, with the bucket lock
+held */
 static void vmfs_inode_register(const vmfs_fs_t *fs,vmfs_inode_t *inode)
 {
    u_int hb;
@@ -163,6 +164,7 @@ static void vmfs_inode_register(const vmfs_fs_t *fs,vmfs_inode_t *inode)
 
    inode->fs = fs;
    inode->ref_count = 1;
+   m_mutex_init_recursive(&inode->lock);
    
    /* Insert into hash table */
    inode->next  = fs->inodes[hb];
@@ -177,48 +179,85 @@ static void vmfs_inode_register(const vmfs_fs_t *fs,vmfs_inode_t *inode)
 /* Acquire an inode */
 vmfs_inode_t *vmfs_inode_acquire(const vmfs_fs_t *fs,uint32_t blk_id)
 {
+   vmfs_fs_t *wfs = (vmfs_fs_t *)fs;
    vmfs_inode_t *inode;
    u_int hb;
 
    hb = vmfs_inode_hash(fs,blk_id);
+   pthread_mutex_lock(&wfs->inode_locks[hb]);
+
    for(inode=fs->inodes[hb];inode;inode=inode->next)
       if (inode->id == blk_id) {
          inode->ref_count++;
-         return inode;
+         goto done;
       }
    
    /* Inode not yet used, allocate room for it */
    if (!(inode = calloc(1,sizeof(*inode))))
-      return NULL;
+      goto done;
 
    if (vmfs_inode_get(fs,blk_id,inode) == -1) {
       free(inode);
-      return NULL;
+      inode = NULL;
+      goto done;
    }
 
    vmfs_inode_register(fs,inode);
+
+ done:
+   pthread_mutex_unlock(&wfs->inode_locks[hb]);
+   return inode;
+}
+
+/* Take another reference on an acquired inode */
+vmfs_inode_t *vmfs_inode_ref(vmfs_inode_t *inode)
+{
+   vmfs_fs_t *fs = (vmfs_fs_t *)inode->fs;
+   u_int hb;
+
+   hb = vmfs_inode_hash(fs,inode->id);
+   pthread_mutex_lock(&fs->inode_locks[hb]);
+   assert(inode->ref_count > 0);
+   inode->ref_count++;
+   pthread_mutex_unlock(&fs->inode_locks[hb]);
    return inode;
 }
 
 /* Release an inode */
 void vmfs_inode_release(vmfs_inode_t *inode)
 {
+   vmfs_fs_t *fs = (vmfs_fs_t *)inode->fs;
+   u_int hb;
+
+   hb = vmfs_inode_hash(fs,inode->id);
+   pthread_mutex_lock(&fs->inode_locks[hb]);
+
    assert(inode->ref_count > 0);
  
    if (--inode->ref_count == 0) {
-      if (inode->update_flags)
+      /* Deleted inodes may share their FD block with a new inode */
+      if (inode->update_flags && !inode->deleted)
          vmfs_inode_update(inode,inode->update_flags & VMFS_INODE_SYNC_BLK);
 
-      if (inode->pprev != NULL) {
-         /* remove the inode from hash table */
-         if (inode->next != NULL)
-            inode->next->pprev = inode->pprev;
+      vmfs_dir_cache_release(inode->dir_cache);
+      inode->dir_cache = NULL;
+
+      /* Deleted inodes were already removed from the hash table */
+      if ((inode->pprev != NULL) || inode->deleted) {
+         if (inode->pprev != NULL) {
+            /* remove the inode from hash table */
+            if (inode->next != NULL)
+               inode->next->pprev = inode->pprev;
 
-         *(inode->pprev) = inode->next;
+            *(inode->pprev) = inode->next;
+         }
 
+         pthread_mutex_destroy(&inode->lock);
          free(inode);
       }
    }
+
+   pthread_mutex_unlock(&fs->inode_locks[hb]);
 }
 
 /* Allocate a new inode */
@@ -228,6 +267,8 @@ int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode)
    off_t fdc_offset;
    uint32_t fdc_blk;
    time_t ct;
+   u_int hb;
+   int res;
 
    time(&ct);
 
@@ -241,11 +282,15 @@ int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode)
    (*inode)->mtime     = ct;
    (*inode)->ctime     = ct;
    (*inode)->atime     = ct;
-   (*inode)->id2       = ++fs->inode_gen;
    (*inode)->mode      = mode;
    (*inode)->cmode     = (*inode)->mode | vmfs_file_type2mode((*inode)->type);
 
-   if ((vmfs_block_alloc(fs,VMFS_BLK_TYPE_FD,&(*inode)->id)) < 0) {
+   pthread_mutex_lock(&fs->alloc_lock);
+   (*inode)->id2 = ++fs->inode_gen;
+   res = vmfs_block_alloc(fs,VMFS_BLK_TYPE_FD,&(*inode)->id);
+   pthread_mutex_unlock(&fs->alloc_lock);
+
+   if (res < 0) {
       free(*inode);
       return(-ENOSPC);
    }
@@ -269,7 +314,11 @@ int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode)
    (*inode)->mdh.pos += fdc_offset % fdc_inode->blk_size;
 
    (*inode)->update_flags |= VMFS_INODE_SYNC_ALL;
+
+   hb = vmfs_inode_hash(fs,(*inode)->id);
+   pthread_mutex_lock(&fs->inode_locks[hb]);
    vmfs_inode_register(fs,*inode);
+   pthread_mutex_unlock(&fs->inode_locks[hb]);
    return(0);
 }
 
@@ -354,6 +403,125 @@ int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint32_t *blk_id)
    return(0);
 }
 
+/* Get the allocation state of a block */
+static enum vmfs_extent_type vmfs_inode_blk_state(uint32_t blk_id)
+{
+   if (!blk_id)
+      return(VMFS_EXTENT_HOLE);
+
+   if ((VMFS_BLK_TYPE(blk_id) == VMFS_BLK_TYPE_FB) && VMFS_BLK_FB_TBZ(blk_id))
+      return(VMFS_EXTENT_TBZ);
+
+   return(VMFS_EXTENT_DATA);
+}
+
+/* Check whether the count-th block following an extent start extends it */
+static int vmfs_inode_extent_continues(const vmfs_extent_t *ext,
+                                       uint32_t blk_id,u_int count,
+                                       int physical)
+{
+   if (vmfs_inode_blk_state(blk_id) != ext->type)
+      return(0);
+
+   if (!physical || (ext->type == VMFS_EXTENT_HOLE))
+      return(1);
+
+   return((VMFS_BLK_TYPE(blk_id) == VMFS_BLK_TYPE_FB) &&
+          (VMFS_BLK_TYPE(ext->blk_id) == VMFS_BLK_TYPE_FB) &&
+          (VMFS_BLK_FB_ITEM(blk_id) == VMFS_BLK_FB_ITEM(ext->blk_id) + count));
+}
+
+/* 
+ * Get the extent starting at the specified position. Pointer blocks are
+ * only read once for all the blocks they cover.
+ */
+int vmfs_inode_get_extent(const vmfs_inode_t *inode,off_t pos,int physical,
+                          vmfs_extent_t *ext)
+{
+   const vmfs_fs_t *fs = inode->fs;
+   DECL_ALIGNED_BUFFER(buf,fs->pbc->bmh.data_size);
+   uint32_t blk_id,pb_blk_id = 0,zla;
+   u_int blk_index,blk_count,blk_per_pb;
+   u_int i,count,pb_index,cur_pb = -1;
+
+   if (!inode->blk_size)
+      return(-EIO);
+
+   if (pos >= inode->size)
+      return(-ENXIO);
+
+   ext->pos = pos;
+
+   zla = inode->zla;
+   if (zla >= VMFS5_ZLA_BASE) {
+      /* Data is stored in the inode itself */
+      if (zla - VMFS5_ZLA_BASE == VMFS_BLK_TYPE_FD) {
+         ext->len = inode->size - pos;
+         ext->type = VMFS_EXTENT_DATA;
+         ext->blk_id = inode->id;
+         return(0);
+      }
+      zla -= VMFS5_ZLA_BASE;
+   }
+
+   blk_index = pos / inode->blk_size;
+   blk_count = (inode->size + inode->blk_size - 1) / inode->blk_size;
+   blk_per_pb = buf_len / sizeof(uint32_t);
+
+   for(count=0;blk_index+count<blk_count;count++) {
+      i = blk_index + count;
+
+      switch(zla) {
+         case VMFS_BLK_TYPE_FB:
+         case VMFS_BLK_TYPE_SB:
+            if (i >= VMFS_INODE_BLK_COUNT)
+               return(-EINVAL);
+
+            blk_id = inode->blocks[i];
+            break;
+
+         case VMFS_BLK_TYPE_PB:
+            pb_index = i / blk_per_pb;
+
+            if (pb_index >= VMFS_INODE_BLK_COUNT)
+               return(-EINVAL);
+
+            if (pb_index != cur_pb) {
+               cur_pb = pb_index;
+               pb_blk_id = inode->blocks[pb_index];
+
+               if (pb_blk_id &&
+                   !vmfs_bitmap_get_item(fs->pbc,
+                                         VMFS_BLK_PB_ENTRY(pb_blk_id),
+                                         VMFS_BLK_PB_ITEM(pb_blk_id),
+                                         buf))
+                  return(-EIO);
+            }
+
+            if (pb_blk_id)
+               blk_id = read_le32(buf,(i % blk_per_pb)*sizeof(uint32_t));
+            else
+               blk_id = 0;
+            break;
+
+         default:
+            /* Unexpected ZLA type */
+            return(-EIO);
+      }
+
+      if (!count) {
+         ext->type = vmfs_inode_blk_state(blk_id);
+         ext->blk_id = blk_id;
+      } else if (!vmfs_inode_extent_continues(ext,blk_id,count,physical)) {
+         break;
+      }
+   }
+
+   ext->len = m_min((uint64_t)(blk_index + count) * inode->blk_size,
+                    inode->size) - pos;
+   return(0);
+}
+
 /* Aggregate a sub-block to a file block */
 static int vmfs_inode_aggregate_fb(vmfs_inode_t *inode)
 {
@@ -604,8 +772,8 @@ int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint32_t *blk_id)
    return(0);
 }
 
-/* Truncate file */
-int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len)
+/* Truncate file, with the inode lock held */
+static int vmfs_inode_truncate_locked(vmfs_inode_t *inode,off_t new_len)
 {
    const vmfs_fs_t *fs = inode->fs;
    u_int i;
@@ -630,18 +798,21 @@ int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len)
       case VMFS_BLK_TYPE_FB:
       case VMFS_BLK_TYPE_SB:
       {
-         u_int start,end;
+         uint32_t free_list[VMFS_INODE_BLK_COUNT];
+         u_int start,end,count = 0;
 
          start = ALIGN_NUM(new_len,inode->blk_size) / inode->blk_size;
-         end   = inode->size / inode->blk_size;
+         end   = m_min(inode->size / inode->blk_size,VMFS_INODE_BLK_COUNT-1);
 
          for(i=start;i<=end;i++) {
             if (inode->blocks[i] != 0) {
-               vmfs_block_free(fs,inode->blocks[i]);
+               free_list[count++] = inode->blocks[i];
                inode->blk_count--;
                inode->blocks[i] = 0;
             }
          }
+
+         vmfs_block_free_list(fs,free_list,count);
          break;
       }
 
@@ -689,6 +860,69 @@ int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len)
    return(0);
 }
 
+/* Truncate file */
+int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len)
+{
+   int res;
+
+   vmfs_inode_lock(inode);
+   res = vmfs_inode_truncate_locked(inode,new_len);
+   vmfs_inode_unlock(inode);
+   return(res);
+}
+
+/* Write the pending changes of an inode to disk */
+int vmfs_inode_sync(vmfs_inode_t *inode)
+{
+   int res = 0;
+
+   vmfs_inode_lock(inode);
+
+   if (inode->update_flags && !inode->deleted) {
+      res = vmfs_inode_update(inode,inode->update_flags & VMFS_INODE_SYNC_BLK);
+
+      if (res == 0)
+         inode->update_flags = 0;
+   }
+
+   vmfs_inode_unlock(inode);
+   return(res);
+}
+
+/* 
+ * Delete an inode whose link count dropped to 0, with the inode lock held.
+ * It is removed from the hash table before its FD block is freed, and never
+ * written back afterwards, since a new inode may reuse that FD block while
+ * references on the deleted one remain.
+ */
+int vmfs_inode_delete(vmfs_inode_t *inode)
+{
+   vmfs_fs_t *fs = (vmfs_fs_t *)inode->fs;
+   u_int hb;
+
+   /* Write the null link count, even when there was nothing to truncate */
+   vmfs_inode_truncate_locked(inode,0);
+   vmfs_inode_update(inode,1);
+
+   hb = vmfs_inode_hash(fs,inode->id);
+   pthread_mutex_lock(&fs->inode_locks[hb]);
+
+   if (inode->pprev != NULL) {
+      if (inode->next != NULL)
+         inode->next->pprev = inode->pprev;
+
+      *(inode->pprev) = inode->next;
+      inode->pprev = NULL;
+      inode->next = NULL;
+   }
+
+   inode->update_flags = 0;
+   inode->deleted = 1;
+   pthread_mutex_unlock(&fs->inode_locks[hb]);
+
+   return(vmfs_block_free(fs,inode->id));
+}
+
 /* Call a function for each allocated block of an inode */
 int vmfs_inode_foreach_block(const vmfs_inode_t *inode,
                              vmfs_inode_foreach_block_cbk_t cbk,
@@ -763,6 +997,7 @@ int vmfs_inode_foreach_block(const vmfs_inode_t *inode,
 int vmfs_inode_stat(const vmfs_inode_t *inode,struct stat *buf)
 {
    memset(buf,0,sizeof(*buf));
+   vmfs_inode_lock(inode);
    buf->st_mode  = inode->cmode;
    buf->st_nlink = inode->nlink;
    buf->st_uid   = inode->uid;
@@ -773,6 +1008,7 @@ int vmfs_inode_stat(const vmfs_inode_t *inode,struct stat *buf)
    buf->st_ctime = inode->ctime;
    buf->st_blksize = M_BLK_SIZE;
    buf->st_blocks  = inode->blk_count * (inode->blk_size / S_BLKSIZE);
+   vmfs_inode_unlock(inode);
    return(0);
 }
 
@@ -793,7 +1029,9 @@ int vmfs_inode_stat_from_blkid(const vmfs_fs_t *fs,uint32_t blk_id,
 /* Change permissions */
 int vmfs_inode_chmod(vmfs_inode_t *inode,mode_t mode)
 {
+   vmfs_inode_lock(inode);
    inode->mode = mode;
    inode->update_flags |= VMFS_INODE_SYNC_META;
+   vmfs_inode_unlock(inode);
    return(0);
 }
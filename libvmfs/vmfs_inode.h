@@ -107,6 +107,38 @@ struct vmfs_inode {
    vmfs_inode_t **pprev,*next;
    u_int ref_count;
    u_int update_flags;
+   u_int deleted;
+   vmfs_dir_cache_t *dir_cache;
+
+   /* Lock protecting the fields above, except hash and ref_count */
+   pthread_mutex_t lock;
+};
+
+/* Lock an inode */
+static inline void vmfs_inode_lock(const vmfs_inode_t *inode)
+{
+   pthread_mutex_lock(&((vmfs_inode_t *)inode)->lock);
+}
+
+/* Unlock an inode */
+static inline void vmfs_inode_unlock(const vmfs_inode_t *inode)
+{
+   pthread_mutex_unlock(&((vmfs_inode_t *)inode)->lock);
+}
+
+/* Allocation state of file blocks */
+enum vmfs_extent_type {
+   VMFS_EXTENT_HOLE = 0,   /* Not allocated, reads as zeroes */
+   VMFS_EXTENT_TBZ,        /* Allocated but to be zeroed, reads as zeroes */
+   VMFS_EXTENT_DATA,       /* Allocated */
+};
+
+/* Range of blocks sharing the same allocation state */
+struct vmfs_extent {
+   off_t pos;
+   uint64_t len;
+   enum vmfs_extent_type type;
+   uint32_t blk_id;        /* First block of the extent */
 };
 
 /* Callback function for vmfs_inode_foreach_block() */
@@ -124,6 +156,9 @@ int vmfs_inode_get(const vmfs_fs_t *fs,uint32_t blk_id,vmfs_inode_t *inode);
 /* Acquire an inode */
 vmfs_inode_t *vmfs_inode_acquire(const vmfs_fs_t *fs,uint32_t blk_id);
 
+/* Take another reference on an acquired inode */
+vmfs_inode_t *vmfs_inode_ref(vmfs_inode_t *inode);
+
 /* Release an inode */
 void vmfs_inode_release(vmfs_inode_t *inode);
 
@@ -136,12 +171,25 @@ int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode);
  */
 int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint32_t *blk_id);
 
+/* 
+ * Get the extent starting at the specified position. With physical set,
+ * allocated extents also end where blocks stop being contiguous on disk.
+ */
+int vmfs_inode_get_extent(const vmfs_inode_t *inode,off_t pos,int physical,
+                          vmfs_extent_t *ext);
+
 /* Get a block for writing corresponding to the specified position */
 int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint32_t *blk_id);
 
 /* Truncate file */
 int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len);
 
+/* Write the pending changes of an inode to disk */
+int vmfs_inode_sync(vmfs_inode_t *inode);
+
+/* Delete an inode whose link count dropped to 0 */
+int vmfs_inode_delete(vmfs_inode_t *inode);
+
 /* Call a function for each allocated block of an inode */
 int vmfs_inode_foreach_block(const vmfs_inode_t *inode,
                              vmfs_inode_foreach_block_cbk_t cbk,void *opt_arg);
@@ -85,6 +85,23 @@ static ssize_t vmfs_lvm_write(const vmfs_device_t *dev,off_t pos,
    return(vmfs_lvm_io(lvm,pos,(u_char *)buf,len,(vmfs_vol_io_func)vmfs_device_write));
 }
 
+/* Get the host file descriptor and offset of a raw block of data */
+static int vmfs_lvm_map(const vmfs_device_t *dev,off_t pos,size_t len,
+                        int *fd,off_t *fd_pos)
+{
+   vmfs_lvm_t *lvm = (vmfs_lvm_t *)dev;
+   vmfs_volume_t *extent = vmfs_lvm_get_extent_from_offset(lvm,pos);
+
+   if (!extent)
+      return(-1);
+
+   pos -= (uint64_t)extent->vol_info.first_segment * VMFS_LVM_SEGMENT_SIZE;
+   if ((pos + len) > vmfs_lvm_extent_size(extent))
+      return(-1);
+
+   return(vmfs_device_map(&extent->dev,pos,len,fd,fd_pos));
+}
+
 /* Reserve the underlying volume given a LVM position */
 static int vmfs_lvm_reserve(const vmfs_device_t *dev,off_t pos)
 {
@@ -190,6 +207,7 @@ int vmfs_lvm_open(vmfs_lvm_t *lvm)
       lvm->dev.write = vmfs_lvm_write;
    lvm->dev.reserve = vmfs_lvm_reserve;
    lvm->dev.release = vmfs_lvm_release;
+   lvm->dev.map = vmfs_lvm_map;
    lvm->dev.close = vmfs_lvm_close;
    lvm->dev.uuid = &lvm->lvm_info.uuid;
    return(0);
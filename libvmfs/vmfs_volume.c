@@ -30,6 +30,16 @@
 #include "vmfs.h"
 #include "scsi.h"
 
+/* Read raw data from the underlying file, device or image */
+static inline ssize_t vmfs_vol_pread(const vmfs_volume_t *vol,u_char *buf,
+                                     size_t len,off_t pos)
+{
+   if (vol->img)
+      return(vmfs_device_read(&vol->img->dev,pos,buf,len));
+
+   return(m_pread(vol->fd,buf,len,pos));
+}
+
 /* Read a raw block of data on logical volume */
 static ssize_t vmfs_vol_read(const vmfs_device_t *dev,off_t pos,
                              u_char *buf,size_t len)
@@ -37,7 +47,7 @@ static ssize_t vmfs_vol_read(const vmfs_device_t *dev,off_t pos,
    vmfs_volume_t *vol = (vmfs_volume_t *) dev;
    pos += vol->vmfs_base + 0x1000000;
 
-   return(m_pread(vol->fd,buf,len,pos));
+   return(vmfs_vol_pread(vol,buf,len,pos));
 }
 
 /* Write a raw block of data on logical volume */
@@ -50,6 +60,24 @@ static ssize_t vmfs_vol_write(const vmfs_device_t *dev,off_t pos,
    return(m_pwrite(vol->fd,buf,len,pos));
 }
 
+/* Get the host file descriptor and offset of a raw block of data */
+static int vmfs_vol_map(const vmfs_device_t *dev,off_t pos,size_t len,
+                        int *fd,off_t *fd_pos)
+{
+   vmfs_volume_t *vol = (vmfs_volume_t *) dev;
+
+   /* 
+    * Block devices are accessed with direct I/O, which needs aligned I/O,
+    * and images don't store the data as is.
+    */
+   if (vol->is_blkdev || vol->img)
+      return(-1);
+
+   *fd = vol->fd;
+   *fd_pos = pos + vol->vmfs_base + 0x1000000;
+   return(0);
+}
+
 /* Volume reservation */
 static int vmfs_vol_reserve(const vmfs_device_t *dev, off_t pos)
 {
@@ -95,7 +123,7 @@ static int vmfs_volinfo_read(vmfs_volume_t *volume)
    DECL_ALIGNED_BUFFER(buf,1024);
    vmfs_volinfo_t *vol = &volume->vol_info;
 
-   if (m_pread(volume->fd,buf,buf_len,volume->vmfs_base) != buf_len)
+   if (vmfs_vol_pread(volume,buf,buf_len,volume->vmfs_base) != buf_len)
       return(-1);
 
    vol->magic = read_le32(buf,VMFS_VOLINFO_OFS_MAGIC);
@@ -151,7 +179,10 @@ static void vmfs_vol_close(vmfs_device_t *dev)
    vmfs_volume_t *vol = (vmfs_volume_t *) dev;
    if (!vol)
       return;
-   close(vol->fd);
+   if (vol->img)
+      vmfs_device_close(&vol->img->dev);
+   else
+      close(vol->fd);
    free(vol->device);
    free(vol->vol_info.name);
    free(vol);
@@ -180,6 +211,17 @@ vmfs_volume_t *vmfs_vol_open(const char *filename,vmfs_flags_t flags)
    vol->flags = flags;
    fstat(vol->fd,&st);
    vol->is_blkdev = S_ISBLK(st.st_mode);
+
+   /* Images created by imager are read through an image device */
+   if (S_ISREG(st.st_mode) && vmfs_image_probe(vol->fd)) {
+      if (flags.read_write) {
+         fprintf(stderr,"VMFS: Images can only be opened read-only\n");
+         goto err_open;
+      }
+      if (!(vol->img = vmfs_image_open(vol->fd)))
+         goto err_open;
+   }
+
 #if defined(O_DIRECT) || defined(DIRECTIO_ON)
    if (vol->is_blkdev)
 #ifdef O_DIRECT
@@ -198,7 +240,7 @@ vmfs_volume_t *vmfs_vol_open(const char *filename,vmfs_flags_t flags)
       DECL_ALIGNED_BUFFER(buf,512);
       uint16_t magic;
       /* Look for the MBR magic number */
-      m_pread(vol->fd,buf,buf_len,0);
+      vmfs_vol_pread(vol,buf,buf_len,0);
       magic = read_le16(buf, 510);
       if (magic == 0xaa55) {
          /* Scan partition table */
@@ -238,12 +280,15 @@ vmfs_volume_t *vmfs_vol_open(const char *filename,vmfs_flags_t flags)
    vol->dev.read = vmfs_vol_read;
    if (vol->flags.read_write)
       vol->dev.write = vmfs_vol_write;
+   vol->dev.map = vmfs_vol_map;
    vol->dev.close = vmfs_vol_close;
    vol->dev.uuid = &vol->vol_info.lvm_uuid;
 
    return vol;
 
  err_open:
+   if (vol->img)
+      vmfs_device_close(&vol->img->dev);
    free(vol->device);
  err_filename:
    free(vol);
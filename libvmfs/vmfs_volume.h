@@ -124,6 +124,9 @@ struct vmfs_volume {
    int is_blkdev;
    int scsi_reservation;
 
+   /* Image the volume is read from, instead of fd */
+   vmfs_image_t *img;
+
    /* VMFS volume base */
    off_t vmfs_base;
 
@@ -23,13 +23,42 @@
 #include <errno.h>
 #include "vmfs.h"
 
+/* Timeout used for everything on immutable mounts */
+#define VMFS_FUSE_IMMUTABLE_TIMEOUT  (365.0 * 86400.0)
+
+struct vmfs_fuse_cache {
+   double attr_timeout;
+   double entry_timeout;
+   double negative_timeout;
+   int kernel_cache;
+   int immutable;
+};
+
 static vmfs_fs_t *fs;
 
-static inline uint32_t ino2blkid(fuse_ino_t ino)
+/* Kernel cache settings, from the mount options */
+static struct vmfs_fuse_cache cache;
+
+/* Root directory inode, pinned for the whole mount */
+static vmfs_inode_t *root_inode;
+
+/* 
+ * FUSE node ids are the addresses of the in-core inodes. Each lookup reply
+ * keeps a reference on the inode, which is released when the kernel forgets
+ * about it, so that the inode stays valid as long as the node id is used.
+ */
+static inline vmfs_inode_t *ino2inode(fuse_ino_t ino)
 {
    if (ino == FUSE_ROOT_ID)
-      return(VMFS_BLK_FD_BUILD(0, 0, 0));
-   return((uint32_t)ino);
+      return(root_inode);
+   return((vmfs_inode_t *)ino);
+}
+
+static inline fuse_ino_t inode2ino(const vmfs_inode_t *inode)
+{
+   if (inode == root_inode)
+      return(FUSE_ROOT_ID);
+   return((fuse_ino_t)inode);
 }
 
 static inline fuse_ino_t blkid2ino(uint32_t blk_id)
@@ -39,31 +68,86 @@ static inline fuse_ino_t blkid2ino(uint32_t blk_id)
    return((fuse_ino_t)blk_id);
 }
 
+/* Fill a directory entry reply for an inode */
+static void vmfs_fuse_fill_entry(struct fuse_entry_param *entry,
+                                 const vmfs_inode_t *inode)
+{
+   vmfs_inode_stat(inode,&entry->attr);
+   entry->attr.st_ino = blkid2ino(inode->id);
+   entry->ino = inode2ino(inode);
+   entry->generation = 1;
+   entry->attr_timeout = cache.attr_timeout;
+   entry->entry_timeout = cache.entry_timeout;
+}
+
+/* Reply with a directory entry, keeping the inode reference for the kernel */
+static void vmfs_fuse_reply_entry(fuse_req_t req, vmfs_inode_t *inode)
+{
+   struct fuse_entry_param entry = { 0, };
+
+   vmfs_fuse_fill_entry(&entry, inode);
+   if (fuse_reply_entry(req, &entry))
+      vmfs_inode_release(inode);
+}
+
+/* Open a new handle on a file the kernel knows about */
+static vmfs_file_t *vmfs_fuse_file_open(fuse_ino_t ino)
+{
+   return(vmfs_file_open_from_inode(vmfs_inode_ref(ino2inode(ino))));
+}
+
+/* Open a new handle on a directory the kernel knows about */
+static vmfs_dir_t *vmfs_fuse_dir_open(fuse_ino_t ino)
+{
+   return(vmfs_dir_open_from_inode(vmfs_inode_ref(ino2inode(ino))));
+}
+
+static void vmfs_fuse_forget(fuse_req_t req, fuse_ino_t ino,
+                             unsigned long nlookup)
+{
+   vmfs_inode_t *inode = ino2inode(ino);
+
+   while (nlookup--)
+      vmfs_inode_release(inode);
+
+   fuse_reply_none(req);
+}
+
+static void vmfs_fuse_forget_multi(fuse_req_t req, size_t count,
+                                   struct fuse_forget_data *forgets)
+{
+   vmfs_inode_t *inode;
+   uint64_t nlookup;
+   size_t i;
+
+   for (i = 0; i < count; i++) {
+      inode = ino2inode(forgets[i].ino);
+      for (nlookup = forgets[i].nlookup; nlookup; nlookup--)
+         vmfs_inode_release(inode);
+   }
+
+   fuse_reply_none(req);
+}
+
 static void vmfs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
                              struct fuse_file_info *fi)
 {
-   vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
-   struct stat stbuf = { 0, };
+   vmfs_inode_t *inode = ino2inode(ino);
+   struct stat stbuf;
 
-   if (!vmfs_inode_stat_from_blkid(fs, ino2blkid(ino), &stbuf)) {
-      stbuf.st_ino = ino;
-      fuse_reply_attr(req, &stbuf, 1.0);
-   } else
-      fuse_reply_err(req, ENOENT);
+   vmfs_inode_stat(inode,&stbuf);
+   stbuf.st_ino = blkid2ino(inode->id);
+   fuse_reply_attr(req, &stbuf, cache.attr_timeout);
 }
 
 static void vmfs_fuse_setattr(fuse_req_t req, fuse_ino_t ino, 
                               struct stat *attr, int to_set, 
                               struct fuse_file_info *fi) 
 {
-   vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
+   vmfs_inode_t *inode = ino2inode(ino);
    struct stat stbuf = { 0, };
-   vmfs_inode_t *inode;
 
-   if (!(inode = vmfs_inode_acquire(fs,ino2blkid(ino)))) {
-      fuse_reply_err(req, ENOENT);
-      return;
-   }
+   vmfs_inode_lock(inode);
 
    if (to_set & FUSE_SET_ATTR_MODE)
       inode->mode = attr->st_mode;
@@ -83,21 +167,21 @@ static void vmfs_fuse_setattr(fuse_req_t req, fuse_ino_t ino,
    if (to_set & FUSE_SET_ATTR_SIZE)
       vmfs_inode_truncate(inode,attr->st_size);
 
+   vmfs_inode_unlock(inode);
+
    vmfs_inode_stat(inode,&stbuf);
    stbuf.st_ino = blkid2ino(inode->id);
 
-   fuse_reply_attr(req, &stbuf, 1.0);
-   vmfs_inode_release(inode);
+   fuse_reply_attr(req, &stbuf, cache.attr_timeout);
 }
 
 static void vmfs_fuse_readlink(fuse_req_t req,fuse_ino_t ino)
 { 
-   vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
    vmfs_file_t *f;
    size_t str_len;
    char *str;
 
-   if (!(f = vmfs_file_open_from_blkid(fs, ino2blkid(ino)))) {
+   if (!(f = vmfs_fuse_file_open(ino))) {
       fuse_reply_err(req, ENOENT);
       return;
    }
@@ -117,6 +201,7 @@ static void vmfs_fuse_readlink(fuse_req_t req,fuse_ino_t ino)
       return;
    }
 
+   vmfs_file_close(f);
    str[str_len] = 0;
 
    fuse_reply_readlink(req,str);
@@ -126,62 +211,47 @@ static void vmfs_fuse_readlink(fuse_req_t req,fuse_ino_t ino)
 static void vmfs_fuse_mknod(fuse_req_t req,fuse_ino_t parent,const char *name,
                             mode_t mode, dev_t rdev)
 {   
-   struct fuse_entry_param entry = { 0, };
    vmfs_inode_t *inode;
    vmfs_dir_t *dir;
    int res;
 
-   if (!(dir = vmfs_dir_open_from_blkid(fs, ino2blkid(parent)))) {
+   if (!(dir = vmfs_fuse_dir_open(parent))) {
       fuse_reply_err(req, ENOENT);
       return;
    }        
 
-   if ((res = vmfs_file_create(dir,name,mode,&inode)) < 0) {
+   res = vmfs_file_create(dir,name,mode,&inode);
+   vmfs_dir_close(dir);
+
+   if (res < 0) {
       fuse_reply_err(req, -res);
       return;
    }
 
-   vmfs_dir_close(dir);
-
-   vmfs_inode_stat(inode,&entry.attr);
-   entry.ino = entry.attr.st_ino = blkid2ino(inode->id);
-   entry.generation = 1;
-   entry.attr_timeout = 1.0;
-   entry.entry_timeout = 1.0;
-   fuse_reply_entry(req, &entry);
-
-   vmfs_inode_release(inode);
+   vmfs_fuse_reply_entry(req, inode);
 }
 
 static void vmfs_fuse_mkdir(fuse_req_t req, fuse_ino_t parent,
                             const char *name, mode_t mode) 
 {
-   struct fuse_entry_param entry = { 0, };
    vmfs_inode_t *inode;
    vmfs_dir_t *dir;
    int res;
 
-   if (!(dir = vmfs_dir_open_from_blkid(fs, ino2blkid(parent)))) {
+   if (!(dir = vmfs_fuse_dir_open(parent))) {
       fuse_reply_err(req, ENOENT);
       return;
    }        
 
-   if ((res = vmfs_dir_create(dir,name,mode,&inode)) < 0) {
+   res = vmfs_dir_create(dir,name,mode,&inode);
+   vmfs_dir_close(dir);
+
+   if (res < 0) {
       fuse_reply_err(req, -res);
       return;
    }
 
-   vmfs_dir_close(dir);
-
-   vmfs_inode_stat(inode,&entry.attr);
-   entry.ino = entry.attr.st_ino = blkid2ino(inode->id);
-   entry.generation = 1;
-   entry.attr_timeout = 1.0;
-   entry.entry_timeout = 1.0;
-
-   fuse_reply_entry(req, &entry);
-
-   vmfs_inode_release(inode);
+   vmfs_fuse_reply_entry(req, inode);
 }
 
 static void vmfs_fuse_unlink(fuse_req_t req,fuse_ino_t parent,const char *name) 
@@ -189,7 +259,7 @@ static void vmfs_fuse_unlink(fuse_req_t req,fuse_ino_t parent,const char *name)
    vmfs_dir_t *dir;
    int res;
 
-   if (!(dir = vmfs_dir_open_from_blkid(fs, ino2blkid(parent)))) {
+   if (!(dir = vmfs_fuse_dir_open(parent))) {
       fuse_reply_err(req, ENOENT);
       return;
    } 
@@ -205,7 +275,7 @@ static void vmfs_fuse_rmdir(fuse_req_t req,fuse_ino_t parent,const char *name)
    vmfs_dir_t *dir;
    int res;
 
-   if (!(dir = vmfs_dir_open_from_blkid(fs, ino2blkid(parent)))) {
+   if (!(dir = vmfs_fuse_dir_open(parent))) {
       fuse_reply_err(req, ENOENT);
       return;
    } 
@@ -219,10 +289,7 @@ static void vmfs_fuse_rmdir(fuse_req_t req,fuse_ino_t parent,const char *name)
 static void vmfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
                               struct fuse_file_info *fi)
 {
-   vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
-
-   fi->fh = (uint64_t)(unsigned long)
-            vmfs_dir_open_from_blkid(fs, ino2blkid(ino));
+   fi->fh = (uint64_t)(unsigned long)vmfs_fuse_dir_open(ino);
    if (fi->fh)
       fuse_reply_open(req, fi);
    else
@@ -232,22 +299,42 @@ static void vmfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
 static void vmfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
                               off_t off, struct fuse_file_info *fi)
 {
-   char buf[size];
+   vmfs_dir_t *d = (vmfs_dir_t *)(unsigned long)fi->fh;
    const vmfs_dirent_t *entry;
    struct stat st = {0, };
-   size_t sz;
+   size_t sz, pos = 0;
+   char *buf;
 
-   if (!fi->fh) {
+   if (!d) {
       fuse_reply_err(req, EBADF);
       return;
    }
-   if ((entry = vmfs_dir_read((vmfs_dir_t *)(unsigned long)fi->fh))) {
+
+   if (!(buf = malloc(size))) {
+      fuse_reply_err(req, ENOMEM);
+      return;
+   }
+
+   /* The offset of an entry is the index of the entry following it */
+   vmfs_dir_seek(d, off);
+
+   while ((entry = vmfs_dir_read(d))) {
       st.st_mode = vmfs_file_type2mode(entry->type);
       st.st_ino = blkid2ino(entry->block_id);
-      sz = fuse_add_direntry(req, buf, size, entry->name, &st, off + 1);
-      fuse_reply_buf(req, buf, sz);
-   } else
-      fuse_reply_buf(req, NULL, 0);
+      sz = fuse_add_direntry(req, buf + pos, size - pos, entry->name, &st,
+                             ++off);
+
+      /* The entry will be returned by the next request */
+      if (sz > size - pos)
+         break;
+
+      /* Lookups following readdir won't need to read the directory */
+      vmfs_dentry_cache_add(d, entry);
+      pos += sz;
+   }
+
+   fuse_reply_buf(req, buf, pos);
+   free(buf);
 }
 
 static void vmfs_fuse_releasedir(fuse_req_t req, fuse_ino_t ino,
@@ -270,13 +357,13 @@ static void vmfs_fuse_statfs(fuse_req_t req, fuse_ino_t ino)
    memset(&st,0,sizeof(st));
 
    /* Blocks */
-   alloc_count = vmfs_bitmap_allocated_items(fs->fbb);
+   alloc_count = vmfs_fs_get_allocated_items(fs,VMFS_BLK_TYPE_FB);
    st.f_bsize = st.f_frsize = vmfs_fs_get_blocksize(fs);
    st.f_blocks = fs->fbb->bmh.total_items;
    st.f_bfree = st.f_bavail = st.f_blocks - alloc_count;
    
    /* Inodes */
-   alloc_count = vmfs_bitmap_allocated_items(fs->fdc);
+   alloc_count = vmfs_fs_get_allocated_items(fs,VMFS_BLK_TYPE_FD);
    st.f_files = fs->fdc->bmh.total_items;
    st.f_ffree = st.f_favail = st.f_files - alloc_count;
 
@@ -288,35 +375,26 @@ static void vmfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
 {
    struct fuse_entry_param entry = { 0, };
    vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
-   vmfs_dir_t *d = vmfs_dir_open_from_blkid(fs, ino2blkid(parent));
-   const vmfs_dirent_t *rec;
-
-   if (!d) {
-      fuse_reply_err(req, ENOENT);
-      return;
-   }
+   vmfs_inode_t *inode;
+   uint32_t blk_id;
 
-   rec = vmfs_dir_lookup(d, name);
+   blk_id = vmfs_dir_lookup_blkid(fs, ino2inode(parent)->id, name);
 
-   if (rec && !vmfs_inode_stat_from_blkid(fs, rec->block_id, &entry.attr)) {
-      entry.ino = entry.attr.st_ino = blkid2ino(rec->block_id);
-      entry.generation = 1;
-      entry.attr_timeout = 1.0;
-      entry.entry_timeout = 1.0;
+   if (blk_id && (inode = vmfs_inode_acquire(fs, blk_id))) {
+      vmfs_fuse_reply_entry(req, inode);
+   } else if (cache.negative_timeout > 0) {
+      /* Let the kernel remember the entry doesn't exist */
+      entry.entry_timeout = cache.negative_timeout;
       fuse_reply_entry(req, &entry);
    } else
       fuse_reply_err(req, ENOENT);
-
-   vmfs_dir_close(d);
 }
 
 static void vmfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
                            struct fuse_file_info *fi)
 {
-   vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
-
-   fi->fh = (uint64_t)(unsigned long)
-            vmfs_file_open_from_blkid(fs, ino2blkid(ino));
+   fi->fh = (uint64_t)(unsigned long)vmfs_fuse_file_open(ino);
+   fi->keep_cache = cache.kernel_cache;
    if (fi->fh)
       fuse_reply_open(req, fi);
    else
@@ -333,53 +411,118 @@ static void vmfs_fuse_create(fuse_req_t req, fuse_ino_t parent,
    vmfs_file_t *f;
    int res;
 
-   if (!(dir = vmfs_dir_open_from_blkid(fs, ino2blkid(parent)))) {
+   if (!(dir = vmfs_fuse_dir_open(parent))) {
       fuse_reply_err(req, ENOENT);
       return;
    }      
 
-   if ((res = vmfs_file_create(dir,name,mode,&inode)) < 0) {
+   res = vmfs_file_create(dir,name,mode,&inode);
+   vmfs_dir_close(dir);
+
+   if (res < 0) {
       fuse_reply_err(req, -res);
       return;
    }
 
-   vmfs_dir_close(dir);
-
-   if (!(f = vmfs_file_open_from_inode(inode))) {
+   /* The handle takes its own reference, see vmfs_fuse_reply_entry() */
+   if (!(f = vmfs_file_open_from_inode(vmfs_inode_ref(inode)))) {
+      vmfs_inode_release(inode);
       vmfs_inode_release(inode);
       fuse_reply_err(req,ENOMEM);
+      return;
    }
 
    fi->fh = (uint64_t)(unsigned long)f;
 
-   vmfs_inode_stat(inode,&entry.attr);
-   entry.ino = entry.attr.st_ino = blkid2ino(inode->id);
-   entry.generation = 1;
-   entry.attr_timeout = 1.0;
-   entry.entry_timeout = 1.0;
-   fuse_reply_create(req,&entry,fi);
+   vmfs_fuse_fill_entry(&entry, inode);
+   if (fuse_reply_create(req,&entry,fi)) {
+      vmfs_file_close(f);
+      vmfs_inode_release(inode);
+   }
 }
 
 static void vmfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
                            off_t off, struct fuse_file_info *fi)
 {
-   char buf[size];
-   ssize_t sz;
+   vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
+   vmfs_file_t *f = (vmfs_file_t *)(unsigned long)fi->fh;
+   struct fuse_bufvec *bufv;
+   struct fuse_buf *buf;
+   uint64_t file_size,blk_size;
+   u_char *mem = NULL;
+   size_t len,done = 0;
+   off_t fd_pos;
+   ssize_t sz = 0;
+   int fd;
 
    if (!fi->fh) {
       fuse_reply_err(req, EBADF);
       return;
    }
 
-   sz = vmfs_file_pread((vmfs_file_t *)(unsigned long)fi->fh,
-                        (u_char *)buf, size, off);
-
-   if (sz < 0) {
-      fuse_reply_err(req, -sz);
+   file_size = vmfs_file_get_size(f);
+   if (off >= file_size) {
+      fuse_reply_buf(req, NULL, 0);
+      return;
+   }
+   size = m_min(size, file_size - off);
+   blk_size = vmfs_fs_get_blocksize(fs);
+
+   /* 
+    * Each part of the reply ends on a block boundary, so there are at most
+    * as many parts as the number of blocks the request spans.
+    */
+   len = size / blk_size + 2;
+   if (!(bufv = calloc(1, sizeof(*bufv) + len * sizeof(struct fuse_buf)))) {
+      fuse_reply_err(req, ENOMEM);
       return;
    }
 
-   fuse_reply_buf(req, buf, sz);
+   while (done < size) {
+      buf = &bufv->buf[bufv->count];
+
+      /* Let the kernel get data stored as is on the host directly */
+      sz = vmfs_file_map(f, off + done, size - done, &fd, &fd_pos);
+      if (sz > 0) {
+         buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+         buf->fd = fd;
+         buf->pos = fd_pos;
+         buf->size = sz;
+         bufv->count++;
+         done += sz;
+         continue;
+      }
+
+      /* Anything else (holes, sub-blocks, ...) goes through a memory buffer */
+      if (!sz && !mem && !(mem = malloc(size)))
+         sz = -ENOMEM;
+      if (!sz) {
+         len = m_min(blk_size - (off + done) % blk_size, size - done);
+         sz = vmfs_file_pread(f, mem + done, len, off + done);
+      }
+      if (sz <= 0)
+         break;
+
+      if (bufv->count && !(buf[-1].flags & FUSE_BUF_IS_FD)) {
+         buf[-1].size += sz;
+      } else {
+         buf->mem = mem + done;
+         buf->size = sz;
+         bufv->count++;
+      }
+      done += sz;
+
+      if (sz < len)
+         break;
+   }
+
+   if ((sz < 0) && !done)
+      fuse_reply_err(req, -sz);
+   else
+      fuse_reply_data(req, bufv, 0);
+
+   free(mem);
+   free(bufv);
 }
 
 static void vmfs_fuse_write(fuse_req_t req, fuse_ino_t ino, 
@@ -404,18 +547,52 @@ static void vmfs_fuse_write(fuse_req_t req, fuse_ino_t ino,
    fuse_reply_write(req,sz);
 }
 
+/* 
+ * Entry replies keep the inode referenced until forget, so its size and
+ * block list are written back when a handle is flushed or closed.
+ */
+static void vmfs_fuse_flush(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi)
+{
+   if (!fi->fh) {
+      fuse_reply_err(req, EBADF);
+      return;
+   }
+   fuse_reply_err(req, -vmfs_file_sync((vmfs_file_t *)(unsigned long)fi->fh));
+}
+
+static void vmfs_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                            struct fuse_file_info *fi)
+{
+   vmfs_fuse_flush(req, ino, fi);
+}
+
 static void vmfs_fuse_release(fuse_req_t req, fuse_ino_t ino,
                               struct fuse_file_info *fi)
 {
-   if (!fi->fh) {
+   vmfs_file_t *f = (vmfs_file_t *)(unsigned long)fi->fh;
+   int res;
+
+   if (!f) {
       fuse_reply_err(req, EBADF);
       return;
    }
-   vmfs_file_close((vmfs_file_t *)(unsigned long)fi->fh);
-   fuse_reply_err(req, 0);
+   res = vmfs_file_sync(f);
+   vmfs_file_close(f);
+   fuse_reply_err(req, -res);
+}
+
+static void vmfs_fuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+   /* Allow file data to be spliced from the host files, see read */
+   if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+      conn->want |= FUSE_CAP_SPLICE_WRITE;
 }
 
 const static struct fuse_lowlevel_ops vmfs_oper = {
+   .init = vmfs_fuse_init,
+   .forget = vmfs_fuse_forget,
+   .forget_multi = vmfs_fuse_forget_multi,
    .getattr = vmfs_fuse_getattr,
    .setattr = vmfs_fuse_setattr,
    .readlink = vmfs_fuse_readlink,
@@ -432,7 +609,9 @@ const static struct fuse_lowlevel_ops vmfs_oper = {
    .create = vmfs_fuse_create,
    .read = vmfs_fuse_read,
    .write = vmfs_fuse_write,
+   .flush = vmfs_fuse_flush,
    .release = vmfs_fuse_release,
+   .fsync = vmfs_fuse_fsync,
 };
 
 struct vmfs_fuse_opts {
@@ -440,12 +619,22 @@ struct vmfs_fuse_opts {
    char *paths[VMFS_LVM_MAX_EXTENTS + 1];
    char *mountpoint;
    int foreground;
+   struct vmfs_fuse_cache cache;
 };
 
+#define VMFS_FUSE_OPT(t, p, v) { t, offsetof(struct vmfs_fuse_opts, p), v }
+
 static const struct fuse_opt vmfs_fuse_args[] = {
-  { "-d", offsetof(struct vmfs_fuse_opts, foreground), 1 },
-  { "-f", offsetof(struct vmfs_fuse_opts, foreground), 1 },
+  VMFS_FUSE_OPT("-d", foreground, 1),
+  VMFS_FUSE_OPT("-f", foreground, 1),
+  VMFS_FUSE_OPT("attr_timeout=%lf", cache.attr_timeout, 0),
+  VMFS_FUSE_OPT("entry_timeout=%lf", cache.entry_timeout, 0),
+  VMFS_FUSE_OPT("negative_timeout=%lf", cache.negative_timeout, 0),
+  VMFS_FUSE_OPT("kernel_cache", cache.kernel_cache, 1),
+  VMFS_FUSE_OPT("keep_cache", cache.kernel_cache, 1),
+  VMFS_FUSE_OPT("immutable", cache.immutable, 1),
   FUSE_OPT_KEY("-d", FUSE_OPT_KEY_KEEP),
+  FUSE_OPT_END
 };
 
 static int vmfs_fuse_opts_func(void *data, const char *arg, int key,
@@ -489,17 +678,36 @@ int main(int argc, char *argv[])
    flags.allow_missing_extents = 1;
 
    opts.path = &opts.paths[0];
+   opts.cache.attr_timeout = opts.cache.entry_timeout = 1.0;
    if ((fuse_opt_parse(&args, &opts, vmfs_fuse_args,
                        &vmfs_fuse_opts_func) == -1) ||
        (fuse_opt_add_arg(&args, "-odefault_permissions"))) {
       goto cleanup;
    }
 
+   /* Nothing can change behind the kernel's back on read-only mounts */
+   if (opts.cache.immutable) {
+      if (flags.read_write) {
+         fprintf(stderr,"immutable is only allowed on read-only mounts\n");
+         goto cleanup;
+      }
+      opts.cache.attr_timeout = VMFS_FUSE_IMMUTABLE_TIMEOUT;
+      opts.cache.entry_timeout = VMFS_FUSE_IMMUTABLE_TIMEOUT;
+      opts.cache.negative_timeout = VMFS_FUSE_IMMUTABLE_TIMEOUT;
+      opts.cache.kernel_cache = 1;
+   }
+   cache = opts.cache;
+
    if (!(fs = vmfs_fs_open(opts.paths, flags))) {
       fprintf(stderr,"Unable to open filesystem\n");
       goto cleanup;
    }
 
+   if (!(root_inode = vmfs_inode_acquire(fs,VMFS_BLK_FD_BUILD(0, 0, 0)))) {
+      fprintf(stderr,"Unable to open root directory\n");
+      goto cleanup;
+   }
+
    if ((chan = fuse_mount(opts.mountpoint, &args)) != NULL) {
    struct fuse_session *session;
       session = fuse_lowlevel_new(&args, &vmfs_oper,
@@ -508,7 +716,7 @@ int main(int argc, char *argv[])
          fuse_daemonize(opts.foreground);
          if (fuse_set_signal_handlers(session) != -1) {
             fuse_session_add_chan(session, chan);
-            err = fuse_session_loop(session);
+            err = fuse_session_loop_mt(session);
             fuse_remove_signal_handlers(session);
             fuse_session_remove_chan(chan);
          }
@@ -518,6 +726,8 @@ int main(int argc, char *argv[])
    }
 
 cleanup:
+   if (root_inode)
+      vmfs_inode_release(root_inode);
    vmfs_fs_close(fs);
    fuse_opt_free_args(&args);
    opts.path = &opts.paths[0];